@@ -0,0 +1,321 @@
+﻿#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <atomic>
+#include <new>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "ChatProtocol.h"
+#include "ChatQueue.h"
+
+// Connection-count benchmark for ChatServer: opens N clients from one process,
+// then measures how long a broadcast from one of them takes to reach all others.
+//
+// Usage: ChatBench [--host 127.0.0.1] [--port 8080] [--connections 1000]
+//                  [--rounds 20] [--server-pid PID]
+//
+// With --fanout it runs in-process instead and compares copying a broadcast
+// into every recipient's queue with sharing one encoded frame, reporting
+// allocations and bytes copied per broadcast for a growing number of clients.
+
+const int PORT = 8080;
+const int BUFFER_SIZE = 64 * 1024;
+const int MAX_EVENTS = 1024;
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchConfig {
+    std::string host = "127.0.0.1";
+    int port = PORT;
+    int connections = 1000;
+    int rounds = 20;
+    int server_pid = 0;
+    bool fanout = false;
+};
+
+struct BenchClient {
+    int socket = -1;
+    size_t received = 0;
+};
+
+bool parse_args(int argc, char** argv, BenchConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--fanout") {
+            config.fanout = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << "\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--host") config.host = value;
+        else if (arg == "--port") config.port = std::atoi(value.c_str());
+        else if (arg == "--connections") config.connections = std::atoi(value.c_str());
+        else if (arg == "--rounds") config.rounds = std::atoi(value.c_str());
+        else if (arg == "--server-pid") config.server_pid = std::atoi(value.c_str());
+        else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return false;
+        }
+    }
+    return config.connections >= 2 && config.rounds > 0;
+}
+
+// Every allocation in the process is counted so --fanout can report
+// allocations per broadcast
+std::atomic<size_t> allocation_count{ 0 };
+std::atomic<size_t> allocation_bytes{ 0 };
+
+void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+// Each client needs its own descriptor, so lift the soft limit as far as allowed
+void raise_fd_limit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Reads "Threads" and "VmRSS" from /proc so the per-connection cost of the
+// server shows up next to the timings
+std::string read_server_status(int pid) {
+    if (pid <= 0) return ",";
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line, threads, rss_kb;
+    while (std::getline(status, line)) {
+        if (line.rfind("Threads:", 0) == 0) threads = line.substr(line.find_first_not_of(" \t", 8));
+        if (line.rfind("VmRSS:", 0) == 0) {
+            rss_kb = line.substr(line.find_first_not_of(" \t", 6));
+            rss_kb = rss_kb.substr(0, rss_kb.find(' '));
+        }
+    }
+    return threads + "," + rss_kb;
+}
+
+int connect_client(const BenchConfig& config, int index) {
+    int client_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client_socket == -1) return -1;
+
+    sockaddr_in server_address{};
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(config.port);
+    inet_pton(AF_INET, config.host.c_str(), &server_address.sin_addr);
+
+    if (connect(client_socket, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
+        close(client_socket);
+        return -1;
+    }
+
+    std::string username = "bench" + std::to_string(index);
+    if (!send_frame(client_socket, username)) {
+        close(client_socket);
+        return -1;
+    }
+    return client_socket;
+}
+
+struct FanoutResult {
+    double allocations = 0;
+    double bytes_allocated = 0;
+    double bytes_copied = 0;
+    double micros = 0;
+};
+
+// Broadcasts `rounds` messages to `recipients` queues that write into
+// socketpairs, either encoding one shared frame per broadcast or one frame per
+// recipient the way a copying queue would
+FanoutResult run_fanout(int recipients, int rounds, bool shared) {
+    std::vector<int> writers(recipients), readers(recipients);
+    for (int i = 0; i < recipients; ++i) {
+        int pair[2];
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair);
+        writers[i] = pair[0];
+        readers[i] = pair[1];
+    }
+    std::vector<OutboundQueue> queues(recipients);
+    std::vector<char> drain(BUFFER_SIZE);
+    std::string username = "sender";
+    std::string payload(100, 'x');
+
+    FanoutResult result;
+    for (int round = 0; round < rounds; ++round) {
+        size_t allocations_before = allocation_count.load();
+        size_t bytes_before = allocation_bytes.load();
+        auto start = Clock::now();
+
+        if (shared) {
+            SharedFrame frame = SharedFrame::encode({ username, ": ", payload });
+            result.bytes_copied += frame.size();
+            for (auto& queue : queues) {
+                queue.push(frame);
+            }
+        } else {
+            for (auto& queue : queues) {
+                SharedFrame frame = SharedFrame::encode({ username, ": ", payload });
+                result.bytes_copied += frame.size();
+                queue.push(std::move(frame));
+            }
+        }
+        for (int i = 0; i < recipients; ++i) {
+            queues[i].flush_to(writers[i]);
+        }
+
+        result.micros += std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+        result.allocations += allocation_count.load() - allocations_before;
+        result.bytes_allocated += allocation_bytes.load() - bytes_before;
+
+        for (int reader : readers) {
+            while (recv(reader, drain.data(), drain.size(), 0) > 0) {}
+        }
+    }
+
+    for (int i = 0; i < recipients; ++i) {
+        close(writers[i]);
+        close(readers[i]);
+    }
+    result.allocations /= rounds;
+    result.bytes_allocated /= rounds;
+    result.bytes_copied /= rounds;
+    result.micros /= rounds;
+    return result;
+}
+
+int run_fanout_bench(const BenchConfig& config) {
+    std::cout << "strategy,clients,allocs_per_broadcast,bytes_allocated_per_broadcast,"
+                 "bytes_copied_per_broadcast,us_per_broadcast\n";
+    for (int recipients = 1; recipients <= config.connections; recipients *= 10) {
+        for (bool shared : { false, true }) {
+            FanoutResult result = run_fanout(recipients, config.rounds, shared);
+            std::cout << (shared ? "shared" : "copy") << ","
+                      << recipients << ","
+                      << result.allocations << ","
+                      << result.bytes_allocated << ","
+                      << result.bytes_copied << ","
+                      << result.micros << "\n";
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!parse_args(argc, argv, config)) {
+        std::cerr << "Usage: ChatBench [--host H] [--port P] [--connections N] [--rounds R] [--server-pid PID] [--fanout]\n";
+        return 1;
+    }
+    raise_fd_limit();
+    if (config.fanout) {
+        return run_fanout_bench(config);
+    }
+
+    std::vector<BenchClient> clients(config.connections);
+    auto connect_start = Clock::now();
+    for (int i = 0; i < config.connections; ++i) {
+        clients[i].socket = connect_client(config, i);
+        if (clients[i].socket < 0) {
+            std::cerr << "Failed to open connection " << i << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+    }
+    double connect_ms = std::chrono::duration<double, std::milli>(Clock::now() - connect_start).count();
+
+    // connect() returns before the server has accepted; let it catch up so the
+    // first broadcast reaches everyone, then discard the history it replayed
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    std::vector<char> buffer(BUFFER_SIZE);
+    for (BenchClient& client : clients) {
+        while (recv(client.socket, buffer.data(), buffer.size(), MSG_DONTWAIT) > 0) {}
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    for (int i = 1; i < config.connections; ++i) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i].socket, &event);
+    }
+
+    epoll_event events[MAX_EVENTS];
+    size_t expected = 0;
+    double fanout_total_ms = 0;
+    double fanout_max_ms = 0;
+
+    for (int round = 0; round < config.rounds; ++round) {
+        std::string payload = "round " + std::to_string(round);
+        expected += FRAME_HEADER_SIZE + std::string("bench0: ").size() + payload.size();
+
+        auto round_start = Clock::now();
+        send_frame(clients[0].socket, payload);
+
+        int complete = 0;
+        for (int i = 1; i < config.connections; ++i) {
+            if (clients[i].received >= expected) ++complete;
+        }
+        while (complete < config.connections - 1) {
+            int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 5000);
+            if (ready <= 0) {
+                std::cerr << "Timed out waiting for broadcast in round " << round << "\n";
+                return 1;
+            }
+            for (int e = 0; e < ready; ++e) {
+                BenchClient& client = clients[events[e].data.u32];
+                ssize_t bytes = recv(client.socket, buffer.data(), buffer.size(), 0);
+                if (bytes <= 0) {
+                    std::cerr << "Connection to the server lost.\n";
+                    return 1;
+                }
+                bool was_complete = client.received >= expected;
+                client.received += bytes;
+                if (!was_complete && client.received >= expected) ++complete;
+            }
+        }
+
+        double round_ms = std::chrono::duration<double, std::milli>(Clock::now() - round_start).count();
+        fanout_total_ms += round_ms;
+        if (round_ms > fanout_max_ms) fanout_max_ms = round_ms;
+    }
+
+    std::cout << "connections,connect_ms,connects_per_sec,fanout_avg_ms,fanout_max_ms,server_threads,server_rss_kb\n";
+    std::cout << config.connections << ","
+              << connect_ms << ","
+              << config.connections / (connect_ms / 1000.0) << ","
+              << fanout_total_ms / config.rounds << ","
+              << fanout_max_ms << ","
+              << read_server_status(config.server_pid) << "\n";
+
+    for (auto& client : clients) {
+        close(client.socket);
+    }
+    close(epoll_fd);
+    return 0;
+}
@@ -1,7 +1,13 @@
 ﻿#include <iostream>
 #include <thread>
+#include <mutex>
+#include <memory>
 #include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
 #include <cstring>
+#include <cstdlib>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -9,57 +15,160 @@
 #pragma comment(lib, "Ws2_32.lib")
 #else
 #include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #endif
 
+#include "ChatProtocol.h"
+#include "ChatMetrics.h"
+#include "ChatShm.h"
+
 const int PORT = 8080;
-const int BUFFER_SIZE = 1024;
 
 #ifdef _WIN32
 #define close closesocket
+#define poll WSAPoll
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+#ifndef CHAT_HAVE_SHM
+// Stand-in where there is no shared-memory transport; never attaches
+class ShmClient {
+public:
+    bool attached() const { return false; }
+    bool attach(int) { return false; }
+    bool send(std::string_view) { return false; }
+    size_t receive(char*, size_t) { return 0; }
+    bool prepare_wait() { return true; }
+    bool drain_doorbells() { return false; }
+    uint64_t doorbell_epoch() { return 0; }
+    bool wait_for_doorbell(uint64_t) { return false; }
+};
 #endif
 
+// The interactive client sends from two threads: its own messages from the
+// main thread and heartbeat answers from the receiving one
+std::mutex send_mutex;
+ShmClient shm_client;  // attached when --shm was given and the server agreed
+
+bool send_locked(int socket, std::string_view payload) {
+    std::lock_guard<std::mutex> lock(send_mutex);
+    return shm_client.attached() ? shm_client.send(payload) : send_frame(socket, payload);
+}
+
+// Blocks until something arrives, from the shared-memory ring if attached
+int receive_some(int socket, char* buffer, size_t size) {
+    if (!shm_client.attached()) {
+        return recv(socket, buffer, static_cast<int>(size), 0);
+    }
+    while (true) {
+        size_t received = shm_client.receive(buffer, size);
+        if (received > 0) return static_cast<int>(received);
+        // The sending thread may read the doorbell for us while the ring is full
+        uint64_t epoch = shm_client.doorbell_epoch();
+        if (shm_client.prepare_wait() && !shm_client.wait_for_doorbell(epoch)) return 0;
+    }
+}
+
 void receive_messages(int socket) {
-    char buffer[BUFFER_SIZE];
+    FrameReader reader;
     while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(socket, buffer, BUFFER_SIZE, 0);
+        char* tail = reader.write_ptr();
+        int bytes_received = receive_some(socket, tail, reader.writable());
         if (bytes_received <= 0) {
             std::cerr << "Connection to the server lost.\n";
             close(socket);
             exit(0);
         }
-        std::cout << buffer << std::endl;
-    }
-}
+        reader.commit(bytes_received);
 
-int main() {
-#ifdef _WIN32
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        std::cerr << "Winsock initialization error\n";
-        return 1;
+        std::string_view message;
+        while (reader.next(message)) {
+            if (message == "/ping") {
+                send_locked(socket, "/pong");
+                continue;
+            }
+            std::cout << message << std::endl;
+        }
+        if (reader.failed()) {
+            std::cerr << "Received a malformed message from the server.\n";
+            close(socket);
+            exit(0);
+        }
     }
-#endif
+}
 
+int connect_to_server(const std::string& host, int port) {
     int client_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (client_socket == -1) {
-        std::cerr << "Failed to create socket.\n";
         return -1;
     }
 
-    sockaddr_in server_address;
+    sockaddr_in server_address{};
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(PORT);
-    inet_pton(AF_INET, "127.0.0.1", &server_address.sin_addr);
+    server_address.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &server_address.sin_addr);
 
     if (connect(client_socket, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
+        close(client_socket);
+        return -1;
+    }
+    return client_socket;
+}
+
+// For a server on the same host, started with --unix
+int connect_unix(const std::string& path) {
+#ifdef _WIN32
+    (void)path;
+    return -1;
+#else
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    int client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client_socket == -1) {
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    if (connect(client_socket, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(client_socket);
+        return -1;
+    }
+    return client_socket;
+#endif
+}
+
+// ChatClient [--unix PATH [--shm]]: over TCP by default, or over the
+// server's Unix socket, optionally moving on to shared memory
+int run_interactive(int argc, char** argv) {
+    std::string unix_path;
+    bool use_shm = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--unix" && i + 1 < argc) unix_path = argv[++i];
+        else if (arg == "--shm") use_shm = true;
+        else {
+            std::cerr << "Usage: ChatClient [--unix PATH [--shm]]\n";
+            return 1;
+        }
+    }
+
+    int client_socket = unix_path.empty() ? connect_to_server("127.0.0.1", PORT) : connect_unix(unix_path);
+    if (client_socket == -1) {
         std::cerr << "Failed to connect to the server.\n";
         return -1;
     }
+    if (use_shm && !unix_path.empty() && !shm_client.attach(client_socket)) {
+        std::cerr << "Shared memory is not available, staying on the socket.\n";
+    }
 
-    std::cout << "Connected to the server.\n";
+    std::cout << "Connected to the server.\n"
+                 "Commands: /join <room>, /leave <room>, /post <room> <message>, /msg <user> <message>\n";
 
     // Prompt for username
     std::string username;
@@ -67,7 +176,7 @@ int main() {
     std::getline(std::cin, username);
 
     // Send username to the server
-    send(client_socket, username.c_str(), username.size(), 0);
+    send_locked(client_socket, username);
 
     // Start receiving messages
     std::thread(receive_messages, client_socket).detach();
@@ -78,14 +187,287 @@ int main() {
         std::getline(std::cin, message);
         if (message.empty()) continue;
         // Send only the message, not the username
-        send(client_socket, message.c_str(), message.size(), 0);
+        if (!send_locked(client_socket, message)) {
+            std::cerr << "Message is too long or the connection was lost.\n";
+        }
     }
 
     close(client_socket);
+    return 0;
+}
+
+struct BenchOptions {
+    std::string host = "127.0.0.1";
+    int port = PORT;
+    int clients = 100;
+    int senders = 10;
+    double rate = 1000;    // messages per second across all senders
+    double duration = 10;  // seconds of sending
+    int threads = 2;
+    std::string format = "csv";
+    std::string transport = "tcp";  // tcp, unix or shm
+    std::string unix_path = "/tmp/chat.sock";
+};
+
+struct BenchConnection {
+    int socket;
+    std::unique_ptr<ShmClient> shm;  // set when the connection moved to shared memory
+};
+
+struct BenchStats {
+    LatencyHistogram latency;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    bool failed = false;
+    uint64_t since_ns = 0;  // anything sent earlier is history the server replayed
+};
+
+bool parse_bench_args(int argc, char** argv, BenchOptions& options) {
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << "\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--host") options.host = value;
+        else if (arg == "--port") options.port = std::atoi(value.c_str());
+        else if (arg == "--clients") options.clients = std::atoi(value.c_str());
+        else if (arg == "--senders") options.senders = std::atoi(value.c_str());
+        else if (arg == "--rate") options.rate = std::atof(value.c_str());
+        else if (arg == "--duration") options.duration = std::atof(value.c_str());
+        else if (arg == "--threads") options.threads = std::atoi(value.c_str());
+        else if (arg == "--format") options.format = value;
+        else if (arg == "--transport") options.transport = value;
+        else if (arg == "--unix") options.unix_path = value;
+        else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return false;
+        }
+    }
+    options.senders = std::min(options.senders, options.clients);
+    options.threads = std::max(1, std::min(options.threads, options.clients));
+    return options.clients >= 2 && options.senders >= 1 && options.rate > 0 && options.duration > 0 &&
+           (options.format == "csv" || options.format == "json") &&
+           (options.transport == "tcp" || options.transport == "unix" || options.transport == "shm");
+}
+
+// Payloads are "<send time in ns> <sequence>"; the server delivers them as
+// "benchN: <send time> <sequence>", so latency is receive time minus send time
+// on the same steady clock
+void record_latency(std::string_view message, BenchStats& stats) {
+    size_t separator = message.find(": ");
+    if (separator == std::string_view::npos) return;
+    const char* digits = message.data() + separator + 2;
+    const char* end = message.data() + message.size();
+    uint64_t sent_ns = 0;
+    for (; digits < end && *digits >= '0' && *digits <= '9'; ++digits) {
+        sent_ns = sent_ns * 10 + (*digits - '0');
+    }
+    if (sent_ns == 0 || sent_ns < stats.since_ns) return;
+
+    uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    stats.latency.record(now_ns > sent_ns ? (now_ns - sent_ns) / 1000 : 0);
+    ++stats.received;
+}
+
+// Drives a group of clients from one thread: the first `senders` of them post
+// at `rate` messages per second in total, and every client records the
+// latency of what it receives until `stop_at`
+void run_bench_worker(const std::vector<BenchConnection*>& connections, int senders, double rate,
+                      Clock::time_point send_until, Clock::time_point stop_at, BenchStats& stats) {
+    std::vector<pollfd> polls(connections.size());
+    std::vector<FrameReader> readers(connections.size());
+    for (size_t i = 0; i < connections.size(); ++i) {
+        polls[i].fd = connections[i]->socket;
+        polls[i].events = POLLIN;
+    }
+
+    auto send_to = [](BenchConnection& connection, std::string_view payload) {
+        return connection.shm ? connection.shm->send(payload) : send_frame(connection.socket, payload);
+    };
+    auto handle_frames = [&](size_t i) {
+        std::string_view message;
+        while (readers[i].next(message)) {
+            if (message == "/ping") {
+                send_to(*connections[i], "/pong");
+                continue;
+            }
+            record_latency(message, stats);
+        }
+    };
+
+    auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(rate > 0 ? 1.0 / rate : 1.0));
+    auto next_send = Clock::now();
+    uint64_t sequence = 0;
+
+    while (true) {
+        auto now = Clock::now();
+        if (now >= stop_at) break;
+
+        // Send everything that is due, catching up if a poll overran
+        while (senders > 0 && now < send_until && next_send <= now) {
+            uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+            std::string payload = std::to_string(now_ns) + " " + std::to_string(sequence);
+            if (!send_to(*connections[sequence % senders], payload)) {
+                stats.failed = true;
+                return;
+            }
+            ++sequence;
+            ++stats.sent;
+            next_send += interval;
+        }
+
+        // Shared-memory connections are read straight from their rings; poll
+        // only has to wait for a doorbell once a ring is empty
+        bool ring_ready = false;
+        for (size_t i = 0; i < connections.size(); ++i) {
+            ShmClient* shm = connections[i]->shm.get();
+            if (!shm) continue;
+            size_t received;
+            while ((received = shm->receive(readers[i].write_ptr(), readers[i].writable())) > 0) {
+                readers[i].commit(received);
+                handle_frames(i);
+            }
+            if (!shm->prepare_wait()) ring_ready = true;
+        }
+
+        auto wake = now < send_until && senders > 0 ? std::min(next_send, stop_at) : stop_at;
+        int timeout_ms = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count());
+        int ready = poll(polls.data(), static_cast<unsigned long>(polls.size()), ring_ready ? 0 : std::max(timeout_ms, 0));
+        if (ready < 0) {
+            stats.failed = true;
+            return;
+        }
+
+        for (size_t i = 0; i < polls.size() && ready > 0; ++i) {
+            if (!(polls[i].revents & (POLLIN | POLLERR | POLLHUP))) continue;
+            --ready;
+            if (connections[i]->shm) {
+                if (!connections[i]->shm->drain_doorbells()) {
+                    std::cerr << "Connection to the server lost.\n";
+                    stats.failed = true;
+                    return;
+                }
+                continue;
+            }
+            char* tail = readers[i].write_ptr();
+            int bytes_received = recv(connections[i]->socket, tail, static_cast<int>(readers[i].writable()), 0);
+            if (bytes_received <= 0) {
+                std::cerr << "Connection to the server lost.\n";
+                stats.failed = true;
+                return;
+            }
+            readers[i].commit(bytes_received);
+            handle_frames(i);
+        }
+    }
+}
+
+// Headless load generator: opens --clients connections, posts at --rate from
+// --senders of them and prints fan-out latency percentiles and throughput
+int run_bench(int argc, char** argv) {
+    BenchOptions options;
+    if (!parse_bench_args(argc, argv, options)) {
+        std::cerr << "Usage: ChatClient --bench [--host H] [--port P] [--clients N] [--senders S] [--rate MSGS_PER_SEC]\n"
+                     "                          [--duration SECONDS] [--threads T] [--format csv|json]\n"
+                     "                          [--transport tcp|unix|shm] [--unix PATH]\n";
+        return 1;
+    }
+
+    std::vector<BenchConnection> connections(options.clients);
+    for (int i = 0; i < options.clients; ++i) {
+        BenchConnection& connection = connections[i];
+        connection.socket = options.transport == "tcp" ? connect_to_server(options.host, options.port)
+                                                       : connect_unix(options.unix_path);
+        bool connected = connection.socket != -1;
+        if (connected && options.transport == "shm") {
+            connection.shm = std::make_unique<ShmClient>();
+            connected = connection.shm->attach(connection.socket);
+        }
+        std::string username = "bench" + std::to_string(i);
+        if (!connected || !(connection.shm ? connection.shm->send(username) : send_frame(connection.socket, username))) {
+            std::cerr << "Failed to open connection " << i << ".\n";
+            return 1;
+        }
+    }
+
+    // Let the server finish accepting before the first message is timed
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // Clients are dealt out round-robin so every thread gets its share of senders
+    std::vector<std::vector<BenchConnection*>> groups(options.threads);
+    std::vector<int> group_senders(options.threads, 0);
+    for (int i = 0; i < options.clients; ++i) {
+        groups[i % options.threads].push_back(&connections[i]);
+        if (i < options.senders) ++group_senders[i % options.threads];
+    }
+
+    auto start = Clock::now();
+    auto send_until = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+    auto stop_at = send_until + std::chrono::seconds(1);  // grace period for messages in flight
+
+    std::vector<BenchStats> stats(options.threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < options.threads; ++t) {
+        stats[t].since_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count();
+        double rate = options.rate * group_senders[t] / options.senders;
+        workers.emplace_back(run_bench_worker, std::cref(groups[t]), group_senders[t], rate,
+                             send_until, stop_at, std::ref(stats[t]));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    BenchStats total;
+    for (const BenchStats& part : stats) {
+        total.latency.merge(part.latency);
+        total.sent += part.sent;
+        total.received += part.received;
+        total.failed = total.failed || part.failed;
+    }
+    for (BenchConnection& connection : connections) {
+        close(connection.socket);
+    }
+
+    double delivered_per_sec = total.received / options.duration;
+    uint64_t expected = total.sent * (options.clients - 1);
+    if (options.format == "json") {
+        std::cout << "{\"clients\":" << options.clients << ",\"senders\":" << options.senders
+                  << ",\"target_rate\":" << options.rate << ",\"sent\":" << total.sent
+                  << ",\"delivered\":" << total.received << ",\"expected\":" << expected
+                  << ",\"delivered_per_sec\":" << delivered_per_sec
+                  << ",\"p50_us\":" << total.latency.percentile(0.50)
+                  << ",\"p99_us\":" << total.latency.percentile(0.99)
+                  << ",\"p999_us\":" << total.latency.percentile(0.999)
+                  << ",\"max_us\":" << total.latency.max() << "}\n";
+    } else {
+        std::cout << "clients,senders,target_rate,sent,delivered,expected,delivered_per_sec,p50_us,p99_us,p999_us,max_us\n"
+                  << options.clients << "," << options.senders << "," << options.rate << ","
+                  << total.sent << "," << total.received << "," << expected << ","
+                  << delivered_per_sec << ","
+                  << total.latency.percentile(0.50) << ","
+                  << total.latency.percentile(0.99) << ","
+                  << total.latency.percentile(0.999) << ","
+                  << total.latency.max() << "\n";
+    }
+    return total.failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "Winsock initialization error\n";
+        return 1;
+    }
+#endif
+
+    int result = argc > 1 && std::string(argv[1]) == "--bench" ? run_bench(argc, argv) : run_interactive(argc, argv);
 
 #ifdef _WIN32
     WSACleanup();
 #endif
 
-    return 0;
-}
\ No newline at end of file
+    return result;
+}
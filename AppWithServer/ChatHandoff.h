@@ -0,0 +1,94 @@
+﻿#pragma once
+
+// Upgrade handoff between a running ChatServer and the one replacing it.
+// The running server listens on a Unix socket (--upgrade-socket); the new
+// one connects to it (--takeover) and the two exchange frames, with file
+// descriptors passed alongside as in ChatShm.h:
+//
+//   new -> old   "takeover clients" or "takeover listeners"
+//   old -> new   "listener tcp" with a listening socket, one per event loop
+//   old -> new   "listener unix" with the Unix socket listener, if any
+//   old -> new   "client <state>" with a connection, once per client handed
+//                over when the new server asked for its clients
+//   old -> new   "done"
+//
+// The listening sockets are the same sockets, so connections waiting in
+// their backlogs are accepted by the new server, not refused. A client
+// handed over keeps its connection, name and rooms, and the bytes either
+// side had not processed yet; it does not notice the switch. Clients that
+// stay behind are told to reconnect and closed a few at a time over the
+// drain period, so they do not all come back at once. The old server
+// closes its log before "done", and the new one opens it after.
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+#include "ChatProtocol.h"
+
+// A client's state travels in one frame; its unsent output alone may be up
+// to the queue limit
+const size_t MAX_HANDOFF_FRAME = 1u << 30;
+
+struct HandoffClient {
+    bool has_username = false;
+    bool local = false;  // came in over the Unix socket
+    std::string username;
+    std::vector<std::string> rooms;
+    std::string input;   // received, not processed yet
+    std::string output;  // queued, not written yet; may start inside a frame
+};
+
+// Fields are written as 4-byte big-endian lengths followed by the bytes,
+// flags as one byte
+inline void put_handoff_field(std::string& out, std::string_view field) {
+    append_frame(out, field);
+}
+
+inline bool get_handoff_field(std::string_view& in, std::string_view& field) {
+    if (in.size() < FRAME_HEADER_SIZE) return false;
+    uint32_t length = (uint32_t(uint8_t(in[0])) << 24) | (uint32_t(uint8_t(in[1])) << 16) |
+                      (uint32_t(uint8_t(in[2])) << 8) | uint32_t(uint8_t(in[3]));
+    if (in.size() - FRAME_HEADER_SIZE < length) return false;
+    field = in.substr(FRAME_HEADER_SIZE, length);
+    in.remove_prefix(FRAME_HEADER_SIZE + length);
+    return true;
+}
+
+inline std::string encode_handoff_client(const HandoffClient& client) {
+    std::string out = "client ";
+    out += static_cast<char>((client.has_username ? 1 : 0) | (client.local ? 2 : 0));
+    put_handoff_field(out, client.username);
+    put_handoff_field(out, client.input);
+    put_handoff_field(out, client.output);
+    for (const std::string& room : client.rooms) {
+        put_handoff_field(out, room);
+    }
+    return out;
+}
+
+// Parses the payload of a "client" frame
+inline bool decode_handoff_client(std::string_view in, HandoffClient& client) {
+    const std::string_view prefix = "client ";
+    if (in.substr(0, prefix.size()) != prefix || in.size() == prefix.size()) return false;
+    in.remove_prefix(prefix.size());
+    uint8_t flags = static_cast<uint8_t>(in[0]);
+    in.remove_prefix(1);
+    client.has_username = flags & 1;
+    client.local = flags & 2;
+
+    std::string_view username, input, output, room;
+    if (!get_handoff_field(in, username) || !get_handoff_field(in, input) || !get_handoff_field(in, output)) {
+        return false;
+    }
+    client.username.assign(username);
+    client.input.assign(input);
+    client.output.assign(output);
+    client.rooms.clear();
+    while (!in.empty()) {
+        if (!get_handoff_field(in, room)) return false;
+        client.rooms.emplace_back(room);
+    }
+    return true;
+}
@@ -0,0 +1,477 @@
+﻿#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "ChatQueue.h"
+
+// Append-only message log split into segment files. The event loops only
+// hand a reference to the broadcast frame to the log, under a short lock; a
+// writer thread gathers everything queued since its last pass into one
+// writev() and one fdatasync(), so a busy server commits many messages per
+// sync and never waits on the disk.
+//
+// Every message gets an offset, its position in the log counted from 0. A
+// segment "chat-<first offset>.log" holds records of
+//     1-byte kind | 4-byte big-endian length | payload
+// which is the message's frame with its kind in front. Next to it,
+// "chat-<first offset>.idx" holds one (offset - first offset, byte position)
+// pair of native 32-bit integers about every INDEX_INTERVAL bytes, so
+// reading from an offset starts close to it instead of at the top of the
+// segment.
+class ChatLog {
+public:
+    enum class Kind : uint8_t {
+        Everyone = 0,
+        Room = 1
+    };
+
+    struct Options {
+        std::string directory;
+        uint64_t segment_bytes = 64 * 1024 * 1024;     // roll to a new segment past this size; under 4 GiB
+        size_t max_pending_bytes = 64 * 1024 * 1024;   // drop messages beyond this while the disk lags
+    };
+
+    struct Stats {
+        std::atomic<uint64_t> records{ 0 };
+        std::atomic<uint64_t> syncs{ 0 };
+        std::atomic<uint64_t> dropped{ 0 };
+    };
+
+    static const uint64_t INDEX_INTERVAL = 4096;
+
+    explicit ChatLog(Options options) : options_(std::move(options)) {}
+
+    ~ChatLog() {
+        close();
+    }
+
+    ChatLog(const ChatLog&) = delete;
+    ChatLog& operator=(const ChatLog&) = delete;
+
+    // Writes out everything still queued, then closes the segment files so
+    // another process may open the log; later appends are refused
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+        close_segment();
+    }
+
+    // Finds the existing segments, cuts a torn record off the end of the last
+    // one and starts the writer thread
+    bool open() {
+        std::error_code error;
+        std::filesystem::create_directories(options_.directory, error);
+        if (error) {
+            std::cerr << "Cannot create log directory " << options_.directory << ": " << error.message() << "\n";
+            return false;
+        }
+        for (const auto& entry : std::filesystem::directory_iterator(options_.directory, error)) {
+            uint64_t base;
+            if (parse_segment_name(entry.path().filename().string(), base)) {
+                segments_.push_back(base);
+            }
+        }
+        std::sort(segments_.begin(), segments_.end());
+
+        bool opened = segments_.empty() ? open_segment(0) : recover_segment(segments_.back());
+        if (!opened) {
+            std::cerr << "Cannot open log segment in " << options_.directory << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        next_offset_ = written_offset_;
+        writer_ = std::thread(&ChatLog::write_loop, this);
+        return true;
+    }
+
+    // Queues a message; never blocks on I/O. Returns false if the writer is
+    // too far behind or has stopped after a write error, and the message was
+    // dropped, or the log is closed.
+    bool append(const SharedFrame& frame, Kind kind) {
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) return false;
+            if (failed_.load(std::memory_order_relaxed) ||
+                pending_bytes_ + frame.size() > options_.max_pending_bytes) {
+                add(stats_.dropped);
+                return false;
+            }
+            wake = pending_.empty();
+            pending_.push_back({ frame, kind });
+            pending_bytes_ += frame.size();
+            ++next_offset_;
+        }
+        if (wake) {
+            wake_.notify_one();
+        }
+        return true;
+    }
+
+    // Offset the next appended message will get
+    uint64_t next_offset() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return next_offset_;
+    }
+
+    const Stats& stats() const { return stats_; }
+
+    // Calls visit(offset, kind, payload) for every logged message from
+    // `offset` on, in order. Sees what the writer has written so far; meant
+    // for startup and tools rather than the hot path.
+    template <typename Visit>
+    void read_from(uint64_t offset, Visit&& visit) const {
+        std::vector<uint64_t> segments;
+        {
+            std::lock_guard<std::mutex> lock(segments_mutex_);
+            segments = segments_;
+        }
+        auto first = std::upper_bound(segments.begin(), segments.end(), offset);
+        if (first != segments.begin()) --first;
+        for (auto it = first; it != segments.end(); ++it) {
+            read_segment(*it, offset, visit);
+        }
+    }
+
+private:
+    struct Pending {
+        SharedFrame frame;
+        Kind kind;
+    };
+
+    struct IndexEntry {
+        uint32_t relative_offset;
+        uint32_t position;
+    };
+
+    Options options_;
+    Stats stats_;
+
+    mutable std::mutex mutex_;  // also guards stats_.dropped, counted from both sides
+    std::condition_variable wake_;
+    std::vector<Pending> pending_;
+    size_t pending_bytes_ = 0;
+    uint64_t next_offset_ = 0;
+    bool stopping_ = false;
+    std::thread writer_;
+
+    // Owned by the writer thread once it runs
+    mutable std::mutex segments_mutex_;
+    std::vector<uint64_t> segments_;  // first offsets, ascending
+    int log_fd_ = -1;
+    int index_fd_ = -1;
+    uint64_t segment_base_ = 0;
+    uint64_t segment_size_ = 0;
+    uint64_t next_index_position_ = 0;
+    uint64_t written_offset_ = 0;
+    std::atomic<bool> failed_{ false };  // set by the writer; appends are dropped from then on
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    std::string segment_path(uint64_t base, const char* extension) const {
+        char name[64];
+        std::snprintf(name, sizeof(name), "chat-%020llu.%s", static_cast<unsigned long long>(base), extension);
+        return options_.directory + "/" + name;
+    }
+
+    static bool parse_segment_name(const std::string& name, uint64_t& base) {
+        unsigned long long value;
+        char tail;
+        if (name.size() != 29 || std::sscanf(name.c_str(), "chat-%20llu.lo%c", &value, &tail) != 2 || tail != 'g') {
+            return false;
+        }
+        base = value;
+        return true;
+    }
+
+    // Parses the record at `position`; false if it is missing or torn
+    static bool parse_record(const char* data, uint64_t size, uint64_t position, Kind& kind, std::string_view& payload) {
+        if (size - position < 1 + FRAME_HEADER_SIZE) return false;
+        const unsigned char* header = reinterpret_cast<const unsigned char*>(data + position);
+        if (header[0] > static_cast<uint8_t>(Kind::Room)) return false;
+        uint32_t length = (uint32_t(header[1]) << 24) | (uint32_t(header[2]) << 16) |
+                          (uint32_t(header[3]) << 8) | uint32_t(header[4]);
+        if (length > MAX_FRAME_SIZE || size - position - 1 - FRAME_HEADER_SIZE < length) return false;
+        kind = static_cast<Kind>(header[0]);
+        payload = std::string_view(data + position + 1 + FRAME_HEADER_SIZE, length);
+        return true;
+    }
+
+    // Walks one segment with a read-only mapping, starting from the last
+    // index entry at or before `offset`
+    template <typename Visit>
+    void read_segment(uint64_t base, uint64_t offset, Visit&& visit) const {
+        int fd = ::open(segment_path(base, "log").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return;
+        struct stat info;
+        if (fstat(fd, &info) < 0 || info.st_size == 0) {
+            ::close(fd);
+            return;
+        }
+        uint64_t size = static_cast<uint64_t>(info.st_size);
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) return;
+        const char* data = static_cast<const char*>(mapping);
+
+        uint64_t current = base;
+        uint64_t position = 0;
+        if (offset > base) {
+            IndexEntry start = find_index_entry(base, offset - base);
+            current = base + start.relative_offset;
+            position = start.position;
+        }
+
+        Kind kind;
+        std::string_view payload;
+        while (position < size && parse_record(data, size, position, kind, payload)) {
+            if (current >= offset) {
+                visit(current, kind, payload);
+            }
+            position += 1 + FRAME_HEADER_SIZE + payload.size();
+            ++current;
+        }
+        munmap(mapping, size);
+    }
+
+    // Binary search of the index for the closest entry at or before `relative`
+    IndexEntry find_index_entry(uint64_t base, uint64_t relative) const {
+        IndexEntry found{ 0, 0 };
+        int fd = ::open(segment_path(base, "idx").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return found;
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            size_t count = static_cast<size_t>(info.st_size) / sizeof(IndexEntry);
+            std::vector<IndexEntry> entries(count);
+            if (count > 0 && pread(fd, entries.data(), count * sizeof(IndexEntry), 0) ==
+                                 static_cast<ssize_t>(count * sizeof(IndexEntry))) {
+                auto it = std::upper_bound(entries.begin(), entries.end(), relative,
+                    [](uint64_t value, const IndexEntry& entry) { return value < entry.relative_offset; });
+                if (it != entries.begin()) found = *(it - 1);
+            }
+        }
+        ::close(fd);
+        return found;
+    }
+
+    bool open_segment(uint64_t base) {
+        log_fd_ = ::open(segment_path(base, "log").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        index_fd_ = ::open(segment_path(base, "idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (log_fd_ == -1 || index_fd_ == -1) return false;
+        segment_base_ = base;
+        segment_size_ = 0;
+        next_index_position_ = 0;
+        written_offset_ = base;
+        std::lock_guard<std::mutex> lock(segments_mutex_);
+        if (segments_.empty() || segments_.back() != base) {
+            segments_.push_back(base);
+        }
+        return true;
+    }
+
+    // Reopens the newest segment for appending: counts its whole records,
+    // truncates anything torn after them and rebuilds its index
+    bool recover_segment(uint64_t base) {
+        std::string path = segment_path(base, "log");
+        int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd == -1) return false;
+        struct stat info;
+        if (fstat(fd, &info) < 0) {
+            ::close(fd);
+            return false;
+        }
+        uint64_t size = static_cast<uint64_t>(info.st_size);
+        std::vector<IndexEntry> index;
+        uint64_t position = 0;
+        uint64_t count = 0;
+        if (size > 0) {
+            void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+            const char* data = static_cast<const char*>(mapping);
+            uint64_t next_index = 0;
+            Kind kind;
+            std::string_view payload;
+            while (parse_record(data, size, position, kind, payload)) {
+                if (position >= next_index) {
+                    index.push_back({ static_cast<uint32_t>(count), static_cast<uint32_t>(position) });
+                    next_index = position + INDEX_INTERVAL;
+                }
+                position += 1 + FRAME_HEADER_SIZE + payload.size();
+                ++count;
+            }
+            munmap(mapping, size);
+        }
+        if (position < size && ftruncate(fd, static_cast<off_t>(position)) < 0) {
+            ::close(fd);
+            return false;
+        }
+        ::close(fd);
+
+        if (!open_segment(base)) return false;
+        segment_size_ = position;
+        written_offset_ = base + count;
+        next_index_position_ = index.empty() ? 0 : index.back().position + INDEX_INTERVAL;
+        return write_all(index_fd_, reinterpret_cast<const char*>(index.data()), index.size() * sizeof(IndexEntry));
+    }
+
+    // False if either file could not be made durable
+    bool close_segment() {
+        bool synced = true;
+        if (log_fd_ != -1) {
+            synced = fdatasync(log_fd_) == 0 && synced;
+            ::close(log_fd_);
+            log_fd_ = -1;
+        }
+        if (index_fd_ != -1) {
+            synced = fdatasync(index_fd_) == 0 && synced;
+            ::close(index_fd_);
+            index_fd_ = -1;
+        }
+        return synced;
+    }
+
+    static bool write_all(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    // writev() that finishes short writes; advances through `iov` in place
+    static bool writev_all(int fd, iovec* iov, int count) {
+        while (count > 0) {
+            ssize_t written = ::writev(fd, iov, count);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            size_t left = static_cast<size_t>(written);
+            while (count > 0 && left >= iov->iov_len) {
+                left -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+                iov->iov_len -= left;
+            }
+        }
+        return true;
+    }
+
+    void write_loop() {
+        std::vector<Pending> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return !pending_.empty() || stopping_; });
+                if (pending_.empty()) return;
+                batch.swap(pending_);
+                pending_bytes_ = 0;
+            }
+            if (!write_batch(batch)) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                add(stats_.dropped, batch.size());
+            }
+            batch.clear();
+        }
+    }
+
+    // One group commit: every queued record in as few writev() calls as the
+    // iovec limit allows, then a single fdatasync(). False if the batch is
+    // not durable, now or since an earlier failure.
+    bool write_batch(const std::vector<Pending>& batch) {
+        static const char KIND_BYTES[] = { static_cast<char>(Kind::Everyone), static_cast<char>(Kind::Room) };
+        static const int MAX_RECORDS_PER_WRITE = IOV_MAX / 2;
+
+        std::vector<iovec> iov;
+        std::vector<IndexEntry> index;
+        iov.reserve(std::min<size_t>(batch.size(), MAX_RECORDS_PER_WRITE) * 2);
+        size_t i = 0;
+        while (i < batch.size() && !failed_) {
+            iov.clear();
+            index.clear();
+            for (; i < batch.size() && iov.size() < static_cast<size_t>(MAX_RECORDS_PER_WRITE) * 2; ++i) {
+                const SharedFrame& frame = batch[i].frame;
+                uint64_t record_size = 1 + frame.size();
+                if (segment_size_ > 0 && segment_size_ + record_size > options_.segment_bytes) {
+                    if (!iov.empty()) break;  // write what is gathered, then roll
+                    roll_segment();
+                    if (failed_) return false;
+                }
+                if (segment_size_ >= next_index_position_) {
+                    index.push_back({ static_cast<uint32_t>(written_offset_ - segment_base_),
+                                      static_cast<uint32_t>(segment_size_) });
+                    next_index_position_ = segment_size_ + INDEX_INTERVAL;
+                }
+                iov.push_back({ const_cast<char*>(&KIND_BYTES[static_cast<uint8_t>(batch[i].kind)]), 1 });
+                iov.push_back({ const_cast<char*>(frame.data()), frame.size() });
+                segment_size_ += record_size;
+                ++written_offset_;
+            }
+            if (iov.empty()) continue;
+            if (!writev_all(log_fd_, iov.data(), static_cast<int>(iov.size())) ||
+                !write_all(index_fd_, reinterpret_cast<const char*>(index.data()), index.size() * sizeof(IndexEntry))) {
+                std::cerr << "Chat log write failed, logging stopped: " << strerror(errno) << "\n";
+                failed_ = true;
+                return false;
+            }
+        }
+        if (failed_) return false;
+        if (fdatasync(log_fd_) < 0) {
+            std::cerr << "Chat log sync failed, logging stopped: " << strerror(errno) << "\n";
+            failed_ = true;
+            return false;
+        }
+        add(stats_.syncs);
+        add(stats_.records, batch.size());
+        return true;
+    }
+
+    // The finished segment is made durable before its successor is created
+    void roll_segment() {
+        if (!close_segment()) {
+            std::cerr << "Chat log sync failed, logging stopped: " << strerror(errno) << "\n";
+            failed_ = true;
+        } else if (!open_segment(written_offset_)) {
+            std::cerr << "Cannot open log segment, logging stopped: " << strerror(errno) << "\n";
+            failed_ = true;
+        }
+    }
+};
@@ -0,0 +1,112 @@
+﻿#pragma once
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+
+// Log-linear latency histogram in microseconds: every power of two is split
+// into SUB_BUCKETS equal steps, so any recorded value is kept to within about
+// 3% while the whole range up to many hours fits in a few kilobytes
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts_(BUCKETS * SUB_BUCKETS, 0) {}
+
+    void record(uint64_t micros) {
+        ++counts_[index_of(micros)];
+        ++total_;
+        max_ = std::max(max_, micros);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+
+    // Upper bound of the bucket holding the given quantile
+    uint64_t percentile(double quantile) const {
+        if (total_ == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(quantile * (total_ - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(upper_bound_of(i), max_);
+            }
+        }
+        return max_;
+    }
+
+private:
+    friend class AtomicHistogram;
+
+    static const size_t SUB_BUCKETS = 32;
+    static const size_t BUCKETS = 32;
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    uint64_t max_ = 0;
+
+    static size_t index_of(uint64_t value) {
+        if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+        size_t exponent = 0;
+        while ((value >> exponent) >= 2 * SUB_BUCKETS) ++exponent;
+        size_t bucket = exponent + 1;
+        if (bucket >= BUCKETS) return BUCKETS * SUB_BUCKETS - 1;
+        return bucket * SUB_BUCKETS + static_cast<size_t>((value >> exponent) - SUB_BUCKETS);
+    }
+
+    static uint64_t upper_bound_of(size_t index) {
+        size_t bucket = index / SUB_BUCKETS;
+        uint64_t step = index % SUB_BUCKETS;
+        if (bucket == 0) return step;
+        size_t exponent = bucket - 1;
+        return ((SUB_BUCKETS + step + 1) << exponent) - 1;
+    }
+};
+
+// LatencyHistogram for a value recorded by one thread and read by another,
+// such as an event loop's timings read by a metrics dump. Recording is two
+// relaxed stores with no read-modify-write, so it costs about as much as
+// the plain histogram; readers copy it into a LatencyHistogram.
+class AtomicHistogram {
+public:
+    AtomicHistogram() : counts_(new std::atomic<uint64_t>[SIZE]) {
+        for (size_t i = 0; i < SIZE; ++i) {
+            counts_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Only ever called by the owning thread
+    void record(uint64_t micros) {
+        std::atomic<uint64_t>& count = counts_[LatencyHistogram::index_of(micros)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total_.store(total_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (micros > max_.load(std::memory_order_relaxed)) {
+            max_.store(micros, std::memory_order_relaxed);
+        }
+    }
+
+    // Adds what has been recorded so far to `out`
+    void merge_into(LatencyHistogram& out) const {
+        for (size_t i = 0; i < SIZE; ++i) {
+            out.counts_[i] += counts_[i].load(std::memory_order_relaxed);
+        }
+        out.total_ += total_.load(std::memory_order_relaxed);
+        out.max_ = std::max(out.max_, max_.load(std::memory_order_relaxed));
+    }
+
+private:
+    static const size_t SIZE = LatencyHistogram::BUCKETS * LatencyHistogram::SUB_BUCKETS;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+    std::atomic<uint64_t> total_{ 0 };
+    std::atomic<uint64_t> max_{ 0 };
+};
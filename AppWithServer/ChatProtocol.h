@@ -0,0 +1,195 @@
+﻿#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#endif
+
+// Wire format shared by ChatServer and ChatClient: every message is sent as a
+// 4-byte big-endian payload length followed by the payload bytes.
+const size_t FRAME_HEADER_SIZE = 4;
+const uint32_t MAX_FRAME_SIZE = 64 * 1024;
+// Clients send at most this much so the server can prefix "username: " and
+// still stay within MAX_FRAME_SIZE
+const size_t MAX_USERNAME_LENGTH = 32;
+const size_t MAX_MESSAGE_SIZE = MAX_FRAME_SIZE - MAX_USERNAME_LENGTH - 2;
+const size_t RECEIVE_CHUNK = 4 * 1024;
+
+// A message that starts with '/' is a command rather than chat text:
+//   /join <room>             subscribe to a room
+//   /leave <room>            unsubscribe from it
+//   /post <room> <message>   send to the room's subscribers only
+//   /msg <user> <message>    send to one user only
+// Plain messages still go to everyone. Room posts arrive as
+// "[room] username: message", direct messages as
+// "username (private): message". Usernames are unique while connected; the
+// server turns away a second client with a name already in use.
+//
+// Heartbeats: a client the server has heard nothing from for a while is sent
+// "/ping" and closed unless something, normally "/pong", arrives in time.
+// Clients may send "/ping" too and get "/pong" back.
+//
+// Clients on the same host can also connect over the server's Unix socket
+// and from there move to shared memory; see ChatShm.h.
+const size_t MAX_ROOM_NAME_LENGTH = 32;
+const size_t MAX_ROOMS_PER_CLIENT = 64;
+
+inline void append_frame(std::string& out, std::string_view payload) {
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    char header[FRAME_HEADER_SIZE] = {
+        static_cast<char>(length >> 24), static_cast<char>(length >> 16),
+        static_cast<char>(length >> 8), static_cast<char>(length)
+    };
+    out.append(header, FRAME_HEADER_SIZE);
+    out.append(payload.data(), payload.size());
+}
+
+inline std::string encode_frame(std::string_view payload) {
+    std::string frame;
+    frame.reserve(FRAME_HEADER_SIZE + payload.size());
+    append_frame(frame, payload);
+    return frame;
+}
+
+// Receive buffer for one connection. recv() writes straight into its free
+// tail, and every complete frame is handed out as a view into the buffer, so
+// several frames that arrive in one recv() are parsed without copying and a
+// frame split across several recv() calls is simply completed later.
+class FrameReader {
+public:
+    // Free space to receive into; grows the buffer if less than RECEIVE_CHUNK is
+    // left, and gives back memory a burst of large frames left behind
+    char* write_ptr() {
+        if (end_ == 0 && buffer_.size() > 4 * RECEIVE_CHUNK) {
+            std::vector<char>(RECEIVE_CHUNK).swap(buffer_);
+        }
+        if (buffer_.size() - end_ < RECEIVE_CHUNK) {
+            reserve_tail();
+        }
+        return buffer_.data() + end_;
+    }
+
+    size_t writable() const { return buffer_.size() - end_; }
+
+    void commit(size_t bytes) { end_ += bytes; }
+
+    // Copies bytes that were received somewhere else, such as a buffer the
+    // kernel picked for an io_uring receive
+    void append(const char* data, size_t size) {
+        while (size > 0) {
+            char* tail = write_ptr();
+            size_t chunk = std::min(size, writable());
+            std::memcpy(tail, data, chunk);
+            commit(chunk);
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+    // Returns the next complete frame, or false if more bytes are needed.
+    // The view stays valid until the next call to write_ptr().
+    bool next(std::string_view& payload) {
+        if (!peek(payload)) {
+            return false;
+        }
+        pop();
+        return true;
+    }
+
+    // Like next(), but leaves the frame to be returned again; pop() then
+    // consumes it
+    bool peek(std::string_view& payload) {
+        size_t available = end_ - begin_;
+        if (failed_ || available < FRAME_HEADER_SIZE) {
+            return false;
+        }
+
+        const unsigned char* header = reinterpret_cast<const unsigned char*>(buffer_.data() + begin_);
+        uint32_t length = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) |
+                          (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+        if (length > MAX_FRAME_SIZE) {
+            failed_ = true;
+            return false;
+        }
+        if (available < FRAME_HEADER_SIZE + length) {
+            return false;
+        }
+
+        payload = std::string_view(buffer_.data() + begin_ + FRAME_HEADER_SIZE, length);
+        peeked_ = FRAME_HEADER_SIZE + length;
+        return true;
+    }
+
+    void pop() {
+        begin_ += peeked_;
+        peeked_ = 0;
+        if (begin_ == end_) {
+            begin_ = end_ = 0;
+        }
+    }
+
+    // Set once the peer announced a frame larger than MAX_FRAME_SIZE
+    bool failed() const { return failed_; }
+
+    // Everything received and not popped yet, partial frame included
+    std::string_view buffered() const {
+        return std::string_view(buffer_.data() + begin_, end_ - begin_);
+    }
+
+private:
+    std::vector<char> buffer_;
+    size_t begin_ = 0;  // first unparsed byte
+    size_t end_ = 0;    // one past the last received byte
+    size_t peeked_ = 0; // size of the frame peek() returned last
+    bool failed_ = false;
+
+    // Moves a partial frame to the front, and only grows the buffer when that
+    // still leaves too little room
+    void reserve_tail() {
+        if (begin_ > 0) {
+            std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        if (buffer_.size() - end_ < RECEIVE_CHUNK) {
+            size_t capacity = buffer_.empty() ? RECEIVE_CHUNK : buffer_.size();
+            while (capacity - end_ < RECEIVE_CHUNK) {
+                capacity *= 2;
+            }
+            buffer_.resize(capacity);
+        }
+    }
+};
+
+// Blocking send of a whole buffer, used by the clients
+inline bool send_all(int socket, const char* data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        int sent = send(socket, data, static_cast<int>(size), 0);
+#else
+        ssize_t sent = send(socket, data, size, MSG_NOSIGNAL);
+#endif
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+inline bool send_frame(int socket, std::string_view payload) {
+    if (payload.size() > MAX_MESSAGE_SIZE) {
+        return false;
+    }
+    std::string frame = encode_frame(payload);
+    return send_all(socket, frame.data(), frame.size());
+}
@@ -0,0 +1,297 @@
+﻿#pragma once
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <initializer_list>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "ChatProtocol.h"
+
+// Immutable, reference-counted encoded frame. A broadcast is encoded into one
+// of these exactly once and every recipient's queue holds a reference to it,
+// so fanning out to N clients costs one allocation and one copy of the payload.
+class SharedFrame {
+public:
+    SharedFrame() = default;
+
+    // Builds header + concatenated parts in a single allocation
+    static SharedFrame encode(std::initializer_list<std::string_view> parts) {
+        size_t payload_size = 0;
+        for (std::string_view part : parts) {
+            payload_size += part.size();
+        }
+
+        void* memory = ::operator new(sizeof(Block) + FRAME_HEADER_SIZE + payload_size);
+        Block* block = new (memory) Block(static_cast<uint32_t>(FRAME_HEADER_SIZE + payload_size));
+        char* out = block->bytes();
+        uint32_t length = static_cast<uint32_t>(payload_size);
+        out[0] = static_cast<char>(length >> 24);
+        out[1] = static_cast<char>(length >> 16);
+        out[2] = static_cast<char>(length >> 8);
+        out[3] = static_cast<char>(length);
+        out += FRAME_HEADER_SIZE;
+        for (std::string_view part : parts) {
+            std::memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+        return SharedFrame(block);
+    }
+
+    // Bytes already in wire format, such as a queue handed over by another
+    // process; they may hold several frames or end inside one, so payload()
+    // means nothing for them
+    static SharedFrame raw(std::string_view bytes) {
+        void* memory = ::operator new(sizeof(Block) + bytes.size());
+        Block* block = new (memory) Block(static_cast<uint32_t>(bytes.size()));
+        std::memcpy(block->bytes(), bytes.data(), bytes.size());
+        return SharedFrame(block);
+    }
+
+    SharedFrame(const SharedFrame& other) : block_(other.block_) {
+        if (block_) block_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    SharedFrame(SharedFrame&& other) noexcept : block_(other.block_) {
+        other.block_ = nullptr;
+    }
+
+    SharedFrame& operator=(SharedFrame other) noexcept {
+        std::swap(block_, other.block_);
+        return *this;
+    }
+
+    ~SharedFrame() {
+        if (block_ && block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            block_->~Block();
+            ::operator delete(block_);
+        }
+    }
+
+    explicit operator bool() const { return block_ != nullptr; }
+
+    // Whole frame, header included, as it goes on the wire
+    const char* data() const { return block_->bytes(); }
+    size_t size() const { return block_->size; }
+
+    std::string_view payload() const {
+        return std::string_view(data() + FRAME_HEADER_SIZE, size() - FRAME_HEADER_SIZE);
+    }
+
+private:
+    struct Block {
+        explicit Block(uint32_t size) : refs(1), size(size) {}
+        char* bytes() { return reinterpret_cast<char*>(this + 1); }
+
+        std::atomic<uint32_t> refs;
+        uint32_t size;
+    };
+
+    explicit SharedFrame(Block* block) : block_(block) {}
+
+    Block* block_ = nullptr;
+};
+
+// The most recent frames, oldest first, capped at `max_frames` frames and
+// `max_bytes` bytes so its memory stays fixed. It holds references to the
+// frames that were broadcast, so replaying history encodes and copies nothing.
+class HistoryRing {
+public:
+    HistoryRing(size_t max_frames, size_t max_bytes) : slots_(max_frames), max_bytes_(max_bytes) {}
+
+    size_t size() const { return count_; }
+    size_t bytes() const { return bytes_; }
+
+    void push(const SharedFrame& frame) {
+        if (slots_.empty() || frame.size() > max_bytes_) return;
+        if (count_ == slots_.size()) {
+            pop_oldest();
+        }
+        while (bytes_ + frame.size() > max_bytes_) {
+            pop_oldest();
+        }
+        slots_[(first_ + count_) % slots_.size()] = frame;
+        ++count_;
+        bytes_ += frame.size();
+    }
+
+    template <typename Visit>
+    void for_each(Visit&& visit) const {
+        for (size_t i = 0; i < count_; ++i) {
+            visit(slots_[(first_ + i) % slots_.size()]);
+        }
+    }
+
+private:
+    std::vector<SharedFrame> slots_;
+    size_t max_bytes_;
+    size_t first_ = 0;
+    size_t count_ = 0;
+    size_t bytes_ = 0;
+
+    void pop_oldest() {
+        bytes_ -= slots_[first_].size();
+        slots_[first_] = SharedFrame();
+        first_ = (first_ + 1) % slots_.size();
+        --count_;
+    }
+};
+
+// Frames waiting to be written to one client. The front frame may already be
+// partly written, and frames handed to an asynchronous send are pinned until
+// it completes; everything behind them is untouched and can still be evicted.
+class OutboundQueue {
+public:
+    enum class FlushResult { Drained, Blocked, Failed };
+
+    bool empty() const { return frames_.empty(); }
+    size_t bytes() const { return bytes_; }
+
+    // `stamp` is any caller-defined time, handed back once the frame has been
+    // written in full
+    void push(SharedFrame frame, uint64_t stamp = 0) {
+        bytes_ += frame.size();
+        frames_.push_back({ std::move(frame), 0, stamp });
+    }
+
+    // Drops the oldest unsent frames until `incoming` more bytes fit under
+    // `limit`, and leaves a single notice frame counting everything skipped.
+    // Returns false if even an emptied queue has no room.
+    bool make_room(size_t incoming, size_t limit) {
+        size_t start = std::max(pinned_, head_offset_ > 0 ? size_t(1) : size_t(0));
+        if (start < frames_.size() && frames_[start].skipped == 0) {
+            frames_.insert(frames_.begin() + start, { SharedFrame(), 0, 0 });
+        }
+        if (start == frames_.size()) {
+            frames_.push_back({ SharedFrame(), 0, 0 });
+        }
+
+        size_t skipped = frames_[start].skipped;
+        if (frames_[start].frame) {
+            bytes_ -= frames_[start].frame.size();
+        }
+        size_t end = start + 1;
+        while (end < frames_.size() && bytes_ + NOTICE_RESERVE + incoming > limit) {
+            bytes_ -= frames_[end].frame.size();
+            // An older notice left behind when the front was pinned or partly
+            // written hands its count on rather than counting as one message
+            skipped += frames_[end].skipped != 0 ? frames_[end].skipped : 1;
+            ++end;
+        }
+        frames_.erase(frames_.begin() + start + 1, frames_.begin() + end);
+
+        if (skipped == 0) {
+            frames_.erase(frames_.begin() + start);
+        } else {
+            std::string notice = "*** " + std::to_string(skipped) + " messages skipped ***";
+            frames_[start].skipped = skipped;
+            frames_[start].frame = SharedFrame::encode({ notice });
+            bytes_ += frames_[start].frame.size();
+        }
+        return bytes_ + incoming <= limit;
+    }
+
+    // Points up to `max` iovecs at the unwritten bytes, oldest first, and
+    // returns how many were filled; `bytes` receives their total length
+    size_t gather(iovec* iov, size_t max, size_t& bytes) const {
+        size_t count = 0;
+        bytes = 0;
+        for (auto it = frames_.begin(); it != frames_.end() && count < max; ++it, ++count) {
+            size_t skip = count == 0 ? head_offset_ : 0;
+            iov[count].iov_base = const_cast<char*>(it->frame.data() + skip);
+            iov[count].iov_len = it->frame.size() - skip;
+            bytes += iov[count].iov_len;
+        }
+        return count;
+    }
+
+    // Appends every unwritten byte to `out`, in the order it would be sent
+    void copy_unsent(std::string& out) const {
+        for (auto it = frames_.begin(); it != frames_.end(); ++it) {
+            size_t skip = it == frames_.begin() ? head_offset_ : 0;
+            out.append(it->frame.data() + skip, it->frame.size() - skip);
+        }
+    }
+
+    // Keeps the first `frames` frames in place while a send that gathered them
+    // is in flight; the next consume() releases them
+    void pin(size_t frames) { pinned_ = frames; }
+
+    // Marks `sent` bytes from the front as written and calls written(stamp)
+    // for every frame that is now complete
+    template <typename Written>
+    void consume(size_t sent, Written&& written) {
+        pinned_ = 0;
+        bytes_ -= sent;
+        size_t consumed = head_offset_ + sent;
+        while (!frames_.empty() && consumed >= frames_.front().frame.size()) {
+            consumed -= frames_.front().frame.size();
+            written(frames_.front().stamp);
+            frames_.pop_front();
+        }
+        head_offset_ = consumed;
+    }
+
+    void consume(size_t sent) {
+        consume(sent, [](uint64_t) {});
+    }
+
+    // Writes until the queue is empty or the socket stops accepting data,
+    // gathering up to MAX_IOV queued frames into each sendmsg() call. Adds
+    // the number of sendmsg() calls made to `calls` when given; `written` is
+    // passed on to consume().
+    template <typename Written>
+    FlushResult flush_to(int socket, uint64_t* calls, Written&& written) {
+        while (!frames_.empty()) {
+            iovec iov[MAX_IOV];
+            size_t requested = 0;
+            msghdr message{};
+            message.msg_iov = iov;
+            message.msg_iovlen = gather(iov, MAX_IOV, requested);
+            ssize_t sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+            if (calls) ++*calls;
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return FlushResult::Blocked;
+                return FlushResult::Failed;
+            }
+
+            consume(sent, written);
+
+            // A short write means the socket buffer is full; wait for EPOLLOUT
+            if (static_cast<size_t>(sent) < requested) {
+                return FlushResult::Blocked;
+            }
+        }
+        return FlushResult::Drained;
+    }
+
+    FlushResult flush_to(int socket) {
+        return flush_to(socket, nullptr, [](uint64_t) {});
+    }
+
+    static const size_t MAX_IOV = 64;
+
+private:
+    static const size_t NOTICE_RESERVE = 64;
+
+    struct Entry {
+        SharedFrame frame;
+        size_t skipped;  // non-zero for a "messages skipped" notice
+        uint64_t stamp;
+    };
+
+    std::deque<Entry> frames_;
+    size_t head_offset_ = 0;  // bytes of the front frame already written
+    size_t pinned_ = 0;       // front frames referenced by a send in flight
+    size_t bytes_ = 0;        // unwritten bytes across all frames
+};
@@ -0,0 +1,102 @@
+﻿#include <gtest/gtest.h>
+
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ChatQueue.h"
+
+namespace {
+
+SharedFrame frame_of(size_t size) {
+    return SharedFrame::encode({ std::string(size, 'x') });
+}
+
+// Payloads of the whole frames still queued, in order
+std::vector<std::string> unsent_payloads(const OutboundQueue& queue) {
+    std::string bytes;
+    queue.copy_unsent(bytes);
+    std::vector<std::string> payloads;
+    FrameReader reader;
+    reader.append(bytes.data(), bytes.size());
+    std::string_view payload;
+    while (reader.next(payload)) {
+        payloads.emplace_back(payload);
+    }
+    return payloads;
+}
+
+size_t skipped_in(const std::vector<std::string>& payloads) {
+    size_t skipped = 0;
+    for (const std::string& payload : payloads) {
+        if (payload.rfind("*** ", 0) == 0) skipped += std::stoul(payload.substr(4));
+    }
+    return skipped;
+}
+
+}  // namespace
+
+TEST(OutboundQueueTest, NoticeCountsEveryEvictedFrame) {
+    OutboundQueue queue;
+    for (int i = 0; i < 10; ++i) {
+        queue.push(frame_of(100));
+    }
+    ASSERT_TRUE(queue.make_room(100, 500));
+    std::vector<std::string> payloads = unsent_payloads(queue);
+    EXPECT_EQ(skipped_in(payloads), 10 - (payloads.size() - 1));
+}
+
+// The first eviction happens while the front frame is in flight, so its
+// notice goes behind it. The send writes only part of the front frame, and
+// the second eviction comes before the rest of it is written.
+TEST(OutboundQueueTest, PartialWriteBetweenTwoEvictions) {
+    OutboundQueue queue;
+    for (int i = 0; i < 10; ++i) {
+        queue.push(frame_of(100));
+    }
+    iovec iov[OutboundQueue::MAX_IOV];
+    size_t requested = 0;
+    queue.pin(queue.gather(iov, 1, requested));
+    ASSERT_TRUE(queue.make_room(0, 600));
+    size_t first_skipped = skipped_in(unsent_payloads(queue));
+    ASSERT_GT(first_skipped, 0u);
+
+    queue.consume(10);
+    for (int i = 0; i < 5; ++i) {
+        queue.push(frame_of(100));
+    }
+    ASSERT_TRUE(queue.make_room(100, 300));
+    queue.consume(FRAME_HEADER_SIZE + 100 - 10);  // the rest of the front frame
+
+    std::vector<std::string> payloads = unsent_payloads(queue);
+    size_t still_queued = 0;
+    for (const std::string& payload : payloads) {
+        if (payload.rfind("*** ", 0) != 0) ++still_queued;
+    }
+    EXPECT_GE(skipped_in(payloads), first_skipped);
+    EXPECT_EQ(1 + still_queued + skipped_in(payloads), 15u);  // the front frame was delivered
+}
+
+// The front frame was gathered for a send that wrote nothing, so its pin is
+// dropped while it is still whole and the next eviction starts in front of
+// the old notice
+TEST(OutboundQueueTest, EvictionAcrossAnOlderNotice) {
+    OutboundQueue queue;
+    for (int i = 0; i < 10; ++i) {
+        queue.push(frame_of(100));
+    }
+    iovec iov[OutboundQueue::MAX_IOV];
+    size_t requested = 0;
+    queue.pin(queue.gather(iov, 1, requested));
+    ASSERT_TRUE(queue.make_room(0, 600));
+    queue.consume(0);
+    ASSERT_TRUE(queue.make_room(100, 300));
+
+    std::vector<std::string> payloads = unsent_payloads(queue);
+    size_t still_queued = 0;
+    for (const std::string& payload : payloads) {
+        if (payload.rfind("*** ", 0) != 0) ++still_queued;
+    }
+    EXPECT_EQ(still_queued + skipped_in(payloads), 10u);
+}
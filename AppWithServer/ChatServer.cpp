@@ -1,114 +1,2195 @@
 ﻿#include <iostream>
-#include <thread>
+#include <string>
 #include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <cerrno>
+#include <cstdlib>
 
-#ifdef _WIN32
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#pragma comment(lib, "Ws2_32.lib")
-#else
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/un.h>
 #include <sys/socket.h>
-#endif
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+
+#include "ChatProtocol.h"
+#include "ChatQueue.h"
+#include "ChatUring.h"
+#include "ChatLog.h"
+#include "ChatMetrics.h"
+#include "ChatTimer.h"
+#include "ChatShm.h"
+#include "ChatHandoff.h"
 
 const int PORT = 8080;
-const int BUFFER_SIZE = 1024;
+const int MAX_EVENTS = 256;
 
-#ifdef _WIN32
-#define close closesocket
-#endif
+// What to do with a client whose outbound queue is full
+enum class SlowConsumerPolicy {
+    Drop,        // discard the new message for that client
+    Disconnect,  // close the client
+    Coalesce     // discard its oldest queued messages and tell it how many were skipped
+};
+
+// What to do with a client sending faster than its rate limit
+enum class RatePolicy {
+    Delay,  // stop reading from it until it is within the limit again
+    Drop,   // discard its excess messages
+    Notify  // discard them and tell it, at most once a second
+};
+
+// How the event loops talk to the kernel
+enum class IoBackend {
+    Epoll,  // readiness events, one syscall per recv/send
+    Uring   // io_uring completions, submitted in batches
+};
 
-std::vector<int> clients;
-std::mutex clients_mutex;
+struct ServerConfig {
+    int port = PORT;
+    size_t queue_limit = 1024 * 1024;  // bytes queued per client before the policy applies
+    SlowConsumerPolicy slow_policy = SlowConsumerPolicy::Drop;
+    int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    IoBackend io = IoBackend::Epoll;
+    int stats_interval = 0;  // seconds between I/O statistics lines, 0 for none
+    size_t history_messages = 100;       // replayed to each client after its username, 0 to disable
+    size_t history_bytes = 256 * 1024;   // memory cap of the history, per event loop
+    std::string unix_path;               // also listen on this Unix socket, empty for none
+    std::string log_dir;                 // where messages are logged, empty for no log
+    uint64_t log_segment_bytes = 64 * 1024 * 1024;
+    std::string metrics_file;            // rewritten every metrics_interval seconds, empty for none
+    int metrics_interval = 10;
+    int heartbeat_interval = 30;  // seconds of silence before a client is pinged, 0 to disable
+    int heartbeat_timeout = 10;   // seconds a pinged client has to answer before it is closed
+    uint64_t rate_messages = 0;   // messages per second each client may send, 0 for no limit
+    uint64_t rate_bytes = 0;      // bytes per second each client may send, 0 for no limit
+    int rate_burst = 2;           // seconds of unused allowance a client may save up
+    RatePolicy rate_policy = RatePolicy::Delay;
+    std::string upgrade_path;     // wait here for a new server to take over, empty for none
+    std::string takeover_path;    // take over from the server waiting here, empty to start afresh
+    bool handoff_clients = true;  // when taking over, ask for the clients as well as the listeners
+    int drain_seconds = 10;       // after handing over, close the clients left here over this long
+};
 
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
+// Stable handle for a connection. Ids are never reused, so a stale id can
+// not reach a newer connection that happens to get the same descriptor. The
+// low bits name the event loop that owns the connection.
+using ClientId = uint64_t;
+const int REACTOR_ID_BITS = 8;
+const int MAX_REACTORS = 1 << REACTOR_ID_BITS;
 
-    // Receive username
-    int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-    if (bytes_received <= 0) {
-        close(client_socket);
-        return;
+// epoll tags that are not clients; client ids start above them
+const ClientId LISTENER_ID = 0;
+const ClientId MAILBOX_ID = 1;
+const ClientId TIMER_ID = 2;
+const ClientId UNIX_LISTENER_ID = 3;
+
+// Resolution of the heartbeat deadlines
+const uint64_t TIMER_TICK_MS = 500;
+
+// io_uring receive buffers, per event loop
+const unsigned URING_ENTRIES = 1024;
+const unsigned URING_BUFFERS = 1024;
+const uint16_t URING_BUFFER_GROUP = 0;
+
+// Token bucket refilled at `rate` tokens per second up to `capacity`. Tokens
+// are kept in millionths, so a refill is one multiply per elapsed
+// microsecond count and needs no floating point. A rate of 0 never limits.
+class TokenBucket {
+public:
+    void configure(uint64_t rate, uint64_t capacity) {
+        rate_ = rate;
+        capacity_ = tokens_ = capacity * SCALE;
     }
-    std::string username(buffer);
 
-    while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            std::cout << username << " disconnected.\n";
-            close(client_socket);
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            clients.erase(std::remove(clients.begin(), clients.end(), client_socket), clients.end());
-            break;
+    void refill(uint64_t now_us) {
+        if (rate_ == 0 || now_us <= last_us_) return;
+        uint64_t elapsed = now_us - last_us_;
+        uint64_t room = capacity_ - tokens_;
+        tokens_ = elapsed > room / rate_ ? capacity_ : tokens_ + elapsed * rate_;
+        last_us_ = now_us;
+    }
+
+    // Microseconds until `amount` tokens are available, 0 if they are now
+    uint64_t wait_us(uint64_t amount) const {
+        uint64_t needed = amount * SCALE;
+        if (rate_ == 0 || needed <= tokens_) return 0;
+        return (needed - tokens_ + rate_ - 1) / rate_;
+    }
+
+    void take(uint64_t amount) {
+        if (rate_ != 0) tokens_ -= amount * SCALE;
+    }
+
+private:
+    static const uint64_t SCALE = 1000000;
+    uint64_t rate_ = 0;
+    uint64_t capacity_ = 0;
+    uint64_t tokens_ = 0;
+    uint64_t last_us_ = 0;
+};
+
+// A client's allowance in messages and in bytes per second
+struct RateLimit {
+    TokenBucket messages;
+    TokenBucket bytes;
+
+    // Takes one frame of `size` bytes and returns 0 if both buckets have
+    // room for it; otherwise takes nothing and returns how many
+    // microseconds until they will
+    uint64_t admit(size_t size, uint64_t now_us) {
+        messages.refill(now_us);
+        bytes.refill(now_us);
+        uint64_t wait = std::max(messages.wait_us(1), bytes.wait_us(size));
+        if (wait == 0) {
+            messages.take(1);
+            bytes.take(size);
         }
+        return wait;
+    }
+};
+
+// State of one connected client, owned by the event loop
+struct Client {
+    ClientId id;
+    int socket;
+    bool has_username = false;
+    bool closing = false;
+    bool want_write = false;  // EPOLLOUT is registered
+    bool flush_pending = false;
+    bool local = false;  // came in over the Unix socket
+    std::string username;
+    std::vector<std::string> rooms;  // rooms this client has joined
+    FrameReader reader;
+    OutboundQueue outbox;
+    size_t dropped = 0;  // messages discarded because the client was too slow
+
+    // Heartbeats: when anything last arrived, when a ping went out that has
+    // not been answered yet, and the next time to look at either
+    uint64_t heard_us = 0;
+    uint64_t pinged_us = 0;
+    TimerWheel::Timer heartbeat;
+
+    // Rate limiting: the allowance, whether reading is paused until it
+    // refills, and messages discarded since the last notice; the timer
+    // ends a pause or sends the next notice
+    RateLimit rate;
+    bool paused = false;
+    size_t throttled = 0;
+    TimerWheel::Timer throttle;
+
+    // io_uring only: requests that still reference this client, and the
+    // message of the one send allowed in flight at a time
+    unsigned in_flight = 0;
+    bool sending = false;
+    bool receiving = false;  // a receive request is armed
+    bool unlisted = false;  // closed, destroyed once in_flight is 0
+    struct SendState {
+        msghdr message;
+        iovec iov[OutboundQueue::MAX_IOV];
+        uint64_t started_us;
+    };
+    std::unique_ptr<SendState> send_state;
+
+    // Set once a local client has moved to shared-memory rings; its socket
+    // then only carries doorbells
+    std::unique_ptr<ShmSegment> shm;
+
+    // Upgrades: waiting for its requests to finish before it is handed to
+    // the new server, or told to reconnect and about to be closed
+    bool handing_off = false;
+    bool leaving = false;
+};
 
-        std::string message = username + ": " + std::string(buffer);
-        std::cout << message << std::endl;
+// Counters, gauges and timings of one event loop. Only the owning loop
+// writes them, with plain relaxed stores; the statistics and metrics
+// threads read them and add up all loops, so nothing on the hot path
+// takes a lock or a contended cache line.
+struct LoopMetrics {
+    std::atomic<uint64_t> syscalls{ 0 };
+    std::atomic<uint64_t> accepted{ 0 };
+    std::atomic<uint64_t> closed{ 0 };
+    std::atomic<uint64_t> frames_in{ 0 };
+    std::atomic<uint64_t> bytes_in{ 0 };
+    std::atomic<uint64_t> frames_out{ 0 };  // queued for a client
+    std::atomic<uint64_t> bytes_out{ 0 };   // written to sockets
+    std::atomic<uint64_t> dropped{ 0 };     // discarded by the slow-consumer policy
+    std::atomic<uint64_t> slow_disconnects{ 0 };
+    std::atomic<uint64_t> idle_disconnects{ 0 };  // closed for not answering a ping
+    std::atomic<uint64_t> rate_limited{ 0 };      // messages delayed or dropped by a rate limit
+    std::atomic<uint64_t> queued_bytes{ 0 };  // gauge, refreshed once per pass
+    std::atomic<uint64_t> uring_buffers_lost{ 0 };  // receive buffers the kernel would not take back
+    AtomicHistogram queue_time_us;  // from queueing a frame until it is fully written
+    AtomicHistogram send_us;        // one client's write: sendmsg() calls, or io_uring submit to completion
 
-        // Broadcast message to all clients
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        for (int client : clients) {
-            if (client != client_socket) {
-                send(client, message.c_str(), message.size(), 0);
+    static void add(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
+
+uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Room subscriptions of the clients one event loop owns. A post walks only
+// that room's member list, and a join or leave edits only that list, so
+// busy rooms never slow down posts to other rooms. Used by the owning loop
+// alone, like the clients themselves.
+class RoomIndex {
+public:
+    using Members = std::vector<Client*>;
+
+    // Null when no local client is in the room
+    const Members* members(const std::string& room) const {
+        auto it = rooms_.find(room);
+        return it == rooms_.end() ? nullptr : &it->second;
+    }
+
+    void join(Client& client, const std::string& room) {
+        rooms_[room].push_back(&client);
+        client.rooms.push_back(room);
+    }
+
+    void leave(Client& client, const std::string& room) {
+        auto it = rooms_.find(room);
+        if (it != rooms_.end()) {
+            Members& members = it->second;
+            auto member = std::find(members.begin(), members.end(), &client);
+            if (member != members.end()) {
+                *member = members.back();
+                members.pop_back();
+            }
+            if (members.empty()) {
+                rooms_.erase(it);
             }
         }
+        client.rooms.erase(std::remove(client.rooms.begin(), client.rooms.end(), room), client.rooms.end());
     }
-}
 
-int main() {
-#ifdef _WIN32
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        std::cerr << "Winsock initialization error\n";
-        return 1;
+    void leave_all(Client& client) {
+        while (!client.rooms.empty()) {
+            leave(client, std::string(client.rooms.back()));
+        }
     }
-#endif
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+private:
+    std::unordered_map<std::string, Members> rooms_;
+};
+
+// Username to connection, for direct messages, shared by all event loops.
+// Names hash to one of SHARDS independently locked maps, so a lookup is one
+// hash and one short lock, and loops registering different names rarely
+// contend. A name belongs to one connection at a time.
+class UserDirectory {
+public:
+    // Returns false if another connection already has the name
+    bool claim(const std::string& name, ClientId id) {
+        Shard& shard = shard_for(name);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.users.emplace(name, id).second;
+    }
+
+    // Gives the name up, unless it belongs to another connection
+    void release(const std::string& name, ClientId id) {
+        Shard& shard = shard_for(name);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.users.find(name);
+        if (it != shard.users.end() && it->second == id) {
+            shard.users.erase(it);
+        }
+    }
+
+    bool find(const std::string& name, ClientId& id) {
+        Shard& shard = shard_for(name);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.users.find(name);
+        if (it == shard.users.end()) return false;
+        id = it->second;
+        return true;
+    }
+
+private:
+    static const size_t SHARDS = 64;
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, ClientId> users;
+    };
+
+    Shard shards_[SHARDS];
+
+    Shard& shard_for(const std::string& name) {
+        return shards_[std::hash<std::string>()(name) % SHARDS];
+    }
+};
+
+// A broadcast or direct message handed from one event loop to another
+struct Delivery {
+    SharedFrame frame;
+    ClientId sender;      // not delivered back to its author
+    std::string room;     // empty for a message to everyone
+    ClientId target = 0;  // set for a direct message, the only client it goes to
+};
+
+// Inbox of one event loop. Producers append under a short lock that never
+// spans a syscall, and only the post that finds the box empty pays for the
+// eventfd write that wakes the owner.
+class Mailbox {
+public:
+    Mailbox() : event_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+    ~Mailbox() {
+        if (event_fd_ != -1) close(event_fd_);
+    }
+
+    Mailbox(const Mailbox&) = delete;
+    Mailbox& operator=(const Mailbox&) = delete;
+
+    int fd() const { return event_fd_; }
+
+    // Moves the whole batch in and leaves it empty. Returns true if it had to
+    // wake the owner.
+    bool post(std::vector<Delivery>& batch) {
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wake = pending_.empty();
+            if (wake) {
+                pending_.swap(batch);
+            } else {
+                std::move(batch.begin(), batch.end(), std::back_inserter(pending_));
+            }
+        }
+        batch.clear();
+        if (wake) {
+            uint64_t one = 1;
+            ssize_t ignored = write(event_fd_, &one, sizeof(one));
+            (void)ignored;
+        }
+        return wake;
+    }
+
+    // Wakes the owner with nothing posted, to look at something else
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(event_fd_, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    // Takes everything posted so far; `out` must be empty
+    void take(std::vector<Delivery>& out) {
+        uint64_t count;
+        ssize_t ignored = read(event_fd_, &count, sizeof(count));
+        (void)ignored;
+        std::lock_guard<std::mutex> lock(mutex_);
+        out.swap(pending_);
+    }
+
+private:
+    int event_fd_;
+    std::mutex mutex_;
+    std::vector<Delivery> pending_;
+};
+
+bool set_non_blocking(int socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags != -1 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// Every event loop opens its own listener on the same port; the kernel then
+// spreads incoming connections across them
+int open_listener(int port) {
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_socket == -1) {
-        std::cerr << "Failed to create socket.\n";
         return -1;
     }
 
-    sockaddr_in server_address;
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        close(server_socket);
+        return -1;
+    }
+
+    sockaddr_in server_address{};
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(PORT);
+    server_address.sin_port = htons(port);
     server_address.sin_addr.s_addr = INADDR_ANY;
 
-    if (bind(server_socket, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
-        std::cerr << "Failed to bind socket.\n";
+    if (bind(server_socket, (struct sockaddr*)&server_address, sizeof(server_address)) < 0 ||
+        listen(server_socket, SOMAXCONN) < 0) {
+        close(server_socket);
         return -1;
     }
+    return server_socket;
+}
 
-    if (listen(server_socket, 5) < 0) {
-        std::cerr << "Error listening.\n";
+// Listener for clients on the same host. Unix sockets have no SO_REUSEPORT,
+// so there is one, shared by all event loops. An owner-only socket gets mode
+// 0600 before it listens, so no one else can connect even for a moment.
+int open_unix_listener(const std::string& path, bool owner_only = false) {
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int server_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_socket == -1) {
         return -1;
     }
 
-    std::cout << "Server started on port " << PORT << ". Waiting for connections...\n";
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    // Only a socket left behind by an earlier run is removed; any other file
+    // at the path stays, and the bind fails
+    struct stat existing{};
+    if (lstat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        unlink(path.c_str());
+    }
+    if (bind(server_socket, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        (owner_only && chmod(path.c_str(), S_IRUSR | S_IWUSR) < 0) ||
+        listen(server_socket, SOMAXCONN) < 0) {
+        close(server_socket);
+        return -1;
+    }
+    return server_socket;
+}
 
-    while (true) {
-        sockaddr_in client_address;
-        socklen_t client_len = sizeof(client_address);
-        int client_socket = accept(server_socket, (struct sockaddr*)&client_address, &client_len);
-        if (client_socket >= 0) {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            clients.push_back(client_socket);
-            std::cout << "New client connected.\n";
-            std::thread(handle_client, client_socket).detach();
+// An upgrade in progress: the connection to the new server, shared by the
+// thread that accepted it and the event loops handing over their clients
+class Handoff {
+public:
+    Handoff(int socket, bool clients, size_t loops) : socket_(socket), clients_(clients), remaining_(loops) {}
+
+    bool wants_clients() const { return clients_; }
+
+    // Sends one client's connection and state. Once a send fails the new
+    // server is gone, and every later client stays here.
+    bool send_client(const HandoffClient& client, int client_socket) {
+        std::string payload = encode_handoff_client(client);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (failed_) return false;
+        if (!send_frame_with_fd(socket_, payload, client_socket)) {
+            failed_ = true;
+            return false;
+        }
+        ++handed_;
+        return true;
+    }
+
+    // Called by each event loop once it has handed over what it will
+    void loop_finished() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --remaining_;
+        finished_.notify_all();
+    }
+
+    // Returns the number of clients handed over once every loop is finished
+    size_t wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        finished_.wait(lock, [this] { return remaining_ == 0; });
+        return handed_;
+    }
+
+private:
+    int socket_;
+    bool clients_;
+    std::mutex mutex_;
+    std::condition_variable finished_;
+    size_t remaining_;
+    size_t handed_ = 0;
+    bool failed_ = false;
+};
+
+// One event loop per thread. Each accepts on its own SO_REUSEPORT listener,
+// reads and writes only the clients it accepted, and hands broadcasts to the
+// other loops through their mailboxes. The loop runs on epoll, or on
+// io_uring where the server was built with it and asked for it; everything
+// above the socket calls is shared.
+class Reactor {
+public:
+    Reactor(int index, const ServerConfig& config, const std::vector<std::unique_ptr<Reactor>>& reactors,
+            ChatLog* log, UserDirectory& users)
+        : index_(index), config_(config), reactors_(reactors), log_(log), users_(users),
+          history_(config.history_messages, config.history_bytes),
+          timers_(TIMER_TICK_MS, now_us() / 1000),
+          ping_frame_(SharedFrame::encode({ "/ping" })), pong_frame_(SharedFrame::encode({ "/pong" })) {}
+
+    ~Reactor() {
+        for (auto& entry : clients_) {
+            close(entry.second->socket);
+        }
+        if (server_socket_ != -1) {
+            close(server_socket_);
+        }
+        if (timer_fd_ != -1) {
+            close(timer_fd_);
+        }
+        if (epoll_fd_ != -1) {
+            close(epoll_fd_);
+        }
+    }
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    // `unix_listener` is the shared Unix socket listener, or -1; `listener`
+    // is one taken over from the previous server, or -1 to open a new one
+    bool start(int unix_listener, int listener = -1) {
+        server_socket_ = listener != -1 ? listener : open_listener(config_.port);
+        unix_socket_ = unix_listener;
+        if (server_socket_ == -1 || mailbox_.fd() == -1) {
+            return false;
+        }
+        outgoing_.resize(reactors_.size());
+        bool timed = config_.heartbeat_interval > 0 || config_.rate_messages > 0 || config_.rate_bytes > 0 ||
+                     !config_.upgrade_path.empty();
+        if (timed && !start_timer()) {
+            return false;
+        }
+
+#ifdef CHAT_HAVE_IO_URING
+        if (config_.io == IoBackend::Uring) {
+            ring_ = std::make_unique<IoUring>();
+            return ring_->init(URING_ENTRIES) &&
+                   ring_->provide_buffers(URING_BUFFER_GROUP, URING_BUFFERS, RECEIVE_CHUNK);
+        }
+#endif
+
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ == -1) {
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = LISTENER_ID;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, server_socket_, &event) < 0) {
+            return false;
+        }
+        event.data.u64 = MAILBOX_ID;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, mailbox_.fd(), &event) < 0) {
+            return false;
+        }
+        event.data.u64 = TIMER_ID;
+        if (timer_fd_ != -1 && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &event) < 0) {
+            return false;
+        }
+        // Every loop waits on the shared listener; EPOLLEXCLUSIVE wakes one
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.u64 = UNIX_LISTENER_ID;
+        return unix_socket_ == -1 || epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, unix_socket_, &event) == 0;
+    }
+
+    void run() {
+        pass_time_us_ = now_us();
+        end_pass();  // sends what restored clients had queued
+#ifdef CHAT_HAVE_IO_URING
+        if (ring_) {
+            run_uring();
+            return;
+        }
+#endif
+        run_epoll();
+    }
+
+    const LoopMetrics& metrics() const { return metrics_; }
+
+    int listener() const { return server_socket_; }
+
+    // Called from the upgrade thread once the new server has the listeners;
+    // the loop picks the handoff up at the end of its current pass
+    void begin_handoff(Handoff& handoff) {
+        handoff_request_.store(&handoff, std::memory_order_release);
+        mailbox_.wake();
+    }
+
+    // Takes over a client handed over by the previous server, before the
+    // loop runs. The client carries on where it was: same name and rooms,
+    // and what it had sent or been sent but not yet processed.
+    bool restore_client(int client_socket, const HandoffClient& state) {
+        pass_time_us_ = now_us();
+        ClientId id = next_client_id();
+        if (epoll_fd_ != -1) {
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = id;
+            if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+                return false;
+            }
+        }
+        Client& client = adopt_client(id, client_socket, state.local);
+        if (state.has_username) {
+            client.username = state.username.substr(0, MAX_USERNAME_LENGTH);
+            client.has_username = true;
+            if (!users_.claim(client.username, client.id)) {
+                schedule_close(client);
+                return true;
+            }
+        }
+        for (const std::string& room : state.rooms) {
+            bool member = std::find(client.rooms.begin(), client.rooms.end(), room) != client.rooms.end();
+            if (valid_room_name(room) && !member && client.rooms.size() < MAX_ROOMS_PER_CLIENT) {
+                rooms_.join(client, room);
+            }
+        }
+        // The unsent output may end inside a frame, so it goes out as it
+        // is, ahead of anything queued from here on
+        if (!state.output.empty()) {
+            client.outbox.push(SharedFrame::raw(state.output), pass_time_us_);
+            queued_bytes_ += state.output.size();
+            client.flush_pending = true;
+            pending_flush_.push_back(&client);
+        }
+        client.reader.append(state.input.data(), state.input.size());
+        process_input(client);
+#ifdef CHAT_HAVE_IO_URING
+        if (ring_ && !client.closing && !client.paused) arm_recv(client);
+#endif
+        return true;
+    }
+
+    // Fills the history from the log before the loop starts
+    void seed_history(const SharedFrame& frame) { history_.push(frame); }
+
+private:
+    int index_;
+    int epoll_fd_ = -1;
+    int server_socket_ = -1;
+    int unix_socket_ = -1;  // shared, closed by main
+    int timer_fd_ = -1;  // ticks the timer wheel while heartbeats or rate limits are on
+    ServerConfig config_;
+    const std::vector<std::unique_ptr<Reactor>>& reactors_;
+    ChatLog* log_;
+    UserDirectory& users_;
+    Mailbox mailbox_;
+    RoomIndex rooms_;
+    HistoryRing history_;  // every loop sees every message, so each keeps its own copy
+    LoopMetrics metrics_;
+    TimerWheel timers_;  // heartbeat and rate limit deadlines of the clients
+    SharedFrame ping_frame_;
+    SharedFrame pong_frame_;
+    uint64_t next_sequence_ = 1;
+    std::unordered_map<ClientId, std::unique_ptr<Client>> clients_;
+    std::vector<ClientId> pending_close_;
+    std::vector<Client*> pending_flush_;
+    std::vector<std::vector<Delivery>> outgoing_;  // per destination loop, posted once per pass
+    std::vector<Delivery> incoming_;
+    uint64_t pass_time_us_ = 0;  // when the current pass started; stamps queued frames
+    uint64_t queued_bytes_ = 0;  // across all clients of this loop
+    std::atomic<Handoff*> handoff_request_{ nullptr };  // set by the upgrade thread
+    Handoff* handoff_ = nullptr;  // picked up by the loop; no more accepting from then on
+    size_t handing_off_ = 0;      // clients still waiting for their requests to finish
+    bool draining_ = false;       // handoff over, the clients left are being closed
+
+    void run_epoll() {
+        epoll_event events[MAX_EVENTS];
+        while (true) {
+            int ready = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+            LoopMetrics::add(metrics_.syscalls);
+            pass_time_us_ = now_us();
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "epoll_wait failed: " << strerror(errno) << "\n";
+                return;
+            }
+
+            for (int i = 0; i < ready; ++i) {
+                ClientId id = events[i].data.u64;
+                if (id == LISTENER_ID || id == UNIX_LISTENER_ID) {
+                    accept_clients(id);
+                    continue;
+                }
+                if (id == MAILBOX_ID) {
+                    receive_deliveries();
+                    continue;
+                }
+                if (id == TIMER_ID) {
+                    expire_timers();
+                    continue;
+                }
+
+                auto it = clients_.find(id);
+                if (it == clients_.end()) continue;
+                Client& client = *it->second;
+
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    schedule_close(client);
+                }
+                if (!client.closing && (events[i].events & EPOLLIN)) {
+                    handle_readable(client);
+                }
+                if (!client.closing && (events[i].events & EPOLLOUT)) {
+                    flush(client);
+                }
+            }
+
+            end_pass();
+        }
+    }
+
+    // Work batched over one pass of the loop, whichever backend runs it
+    void end_pass() {
+        if (!handoff_) {
+            if (Handoff* requested = handoff_request_.load(std::memory_order_acquire)) {
+                start_handoff(*requested);
+            }
+        }
+        if (handoff_ && !draining_ && handing_off_ == 0) {
+            start_draining();
+        }
+        post_outgoing();
+        flush_pending();
+        close_pending();
+        metrics_.queued_bytes.store(queued_bytes_, std::memory_order_relaxed);
+#ifdef CHAT_HAVE_IO_URING
+        if (ring_) metrics_.uring_buffers_lost.store(ring_->buffers_lost(), std::memory_order_relaxed);
+#endif
+    }
+
+    void accept_clients(ClientId listener) {
+        bool local = listener == UNIX_LISTENER_ID;
+        while (true) {
+            int client_socket = accept4(local ? unix_socket_ : server_socket_, nullptr, nullptr,
+                                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+            LoopMetrics::add(metrics_.syscalls);
+            if (client_socket < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    std::cerr << "accept failed: " << strerror(errno) << "\n";
+                }
+                return;
+            }
+
+            ClientId id = next_client_id();
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = id;
+            LoopMetrics::add(metrics_.syscalls);
+            if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+                close(client_socket);
+                continue;
+            }
+            adopt_client(id, client_socket, local);
+        }
+    }
+
+    ClientId next_client_id() {
+        return (next_sequence_++ << REACTOR_ID_BITS) | static_cast<ClientId>(index_);
+    }
+
+    Client& adopt_client(ClientId id, int client_socket, bool local) {
+        auto client = std::make_unique<Client>();
+        client->id = id;
+        client->socket = client_socket;
+        client->local = local;
+        client->heard_us = pass_time_us_;
+        client->heartbeat.data = id;
+        if (handoff_) {
+            // Accepted as the listeners were being handed over; it is
+            // drained like the clients that stay behind
+            timers_.schedule(client->heartbeat, pass_time_us_ / 1000);
+        } else if (config_.heartbeat_interval > 0) {
+            timers_.schedule(client->heartbeat, pass_time_us_ / 1000 + config_.heartbeat_interval * 1000ull);
+        }
+        client->throttle.data = id;
+        uint64_t burst = static_cast<uint64_t>(config_.rate_burst);
+        client->rate.messages.configure(config_.rate_messages, std::max<uint64_t>(1, config_.rate_messages * burst));
+        client->rate.bytes.configure(config_.rate_bytes, std::max<uint64_t>(MAX_FRAME_SIZE, config_.rate_bytes * burst));
+        Client& adopted = *client;
+        clients_.emplace(id, std::move(client));
+        LoopMetrics::add(metrics_.accepted);
+        std::cout << "New client connected.\n";
+        return adopted;
+    }
+
+    void handle_readable(Client& client) {
+        if (client.shm) {
+            handle_doorbell(client);
+            return;
+        }
+        char* tail = client.reader.write_ptr();
+        ssize_t bytes_received = recv(client.socket, tail, client.reader.writable(), 0);
+        LoopMetrics::add(metrics_.syscalls);
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (bytes_received <= 0) {
+            disconnected(client);
+            return;
+        }
+        client.reader.commit(bytes_received);
+        LoopMetrics::add(metrics_.bytes_in, bytes_received);
+        process_input(client);
+    }
+
+    // Moves a local client onto shared-memory rings, see ChatShm.h. Nothing
+    // is queued for it before its username, so the reply is the last thing
+    // written to the socket other than doorbells. Without a segment the
+    // reply carries no fd and the client stays on the socket.
+    void attach_shm(Client& client) {
+        auto segment = std::make_unique<ShmSegment>();
+        int fd = segment->create(SHM_RING_CAPACITY);
+        // Ask for a doorbell with the client's first write; this has to
+        // happen before the reply, after which the client may write at once
+        if (fd != -1) segment->to_server().consumer_sleep();
+        bool sent = send_frame_with_fd(client.socket, "/shm", fd);
+        LoopMetrics::add(metrics_.syscalls);
+        if (fd != -1) close(fd);
+        if (!sent) {
+            schedule_close(client);
+        } else if (fd != -1) {
+            client.shm = std::move(segment);
+        }
+    }
+
+    void handle_doorbell(Client& client) {
+        char bells[64];
+        ssize_t received = recv(client.socket, bells, sizeof(bells), 0);
+        LoopMetrics::add(metrics_.syscalls);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (received <= 0) {
+            disconnected(client);
+            return;
+        }
+        pump_shm(client);
+    }
+
+    // Reads everything the client has put in its ring until it is empty and
+    // the client has been told to ring, then resumes writing in case the
+    // doorbell meant there is room in the other ring again
+    void pump_shm(Client& client) {
+        ShmRing in = client.shm->to_server();
+        process_input(client);  // frames held back by a pause
+        while (!client.closing && !client.paused) {
+            size_t received = in.read(client.reader.write_ptr(), client.reader.writable());
+            if (received == 0) {
+                if (in.consumer_sleep()) break;
+                continue;
+            }
+            client.reader.commit(received);
+            LoopMetrics::add(metrics_.bytes_in, received);
+            // The client sleeps on the doorbell while its ring is full
+            if (in.wake_producer()) ring_doorbell(client.socket);
+            process_input(client);
+        }
+        if (!client.closing && !client.outbox.empty() && !client.flush_pending) {
+            client.flush_pending = true;
+            pending_flush_.push_back(&client);
+        }
+    }
+
+    void disconnected(Client& client) {
+        if (client.has_username) {
+            std::cout << client.username << " disconnected.\n";
+        }
+        schedule_close(client);
+    }
+
+    // Handles every complete frame that has arrived from a client
+    void process_input(Client& client) {
+        // Any traffic shows the client is alive; the wheel is not touched
+        // here, the deadline is only moved once it comes due
+        client.heard_us = pass_time_us_;
+        std::string_view payload;
+        while (!client.closing && !client.paused && client.reader.peek(payload)) {
+            if (client.has_username && !within_rate(client, payload.size())) {
+                if (client.paused) break;  // the frame waits in the reader
+                client.reader.pop();
+                continue;
+            }
+            client.reader.pop();
+            LoopMetrics::add(metrics_.frames_in);
+            // The first frame from a client is its username, unless a local
+            // client asks to switch to shared memory first
+            if (!client.has_username && client.local && !client.shm && payload == "/shm") {
+                attach_shm(client);
+                continue;
+            }
+            if (!client.has_username) {
+                client.username.assign(payload.substr(0, MAX_USERNAME_LENGTH));
+                client.has_username = true;
+                if (!users_.claim(client.username, client.id)) {
+                    turn_away(client, "the username " + client.username + " is taken");
+                    break;
+                }
+                replay_history(client);
+                continue;
+            }
+            if (payload.size() > MAX_MESSAGE_SIZE) {
+                std::cerr << "Oversized message from " << client.username << ", disconnecting.\n";
+                schedule_close(client);
+                break;
+            }
+            if (!payload.empty() && payload[0] == '/') {
+                handle_command(client, payload);
+                continue;
+            }
+
+            SharedFrame frame = SharedFrame::encode({ client.username, ": ", payload });
+            std::cout << frame.payload() << '\n';
+            broadcast(client, frame);
+        }
+
+        if (client.reader.failed()) {
+            std::cerr << "Oversized frame from " << client.username << ", disconnecting.\n";
+            schedule_close(client);
+        }
+    }
+
+    // Charges one frame to the client's rate limit. Over the limit, the frame
+    // is either held back, with reading paused until the allowance has
+    // refilled, or discarded; returns false in both cases.
+    bool within_rate(Client& client, size_t bytes) {
+        uint64_t wait = client.rate.admit(bytes, pass_time_us_);
+        if (wait == 0) return true;
+        LoopMetrics::add(metrics_.rate_limited);
+
+        if (config_.rate_policy == RatePolicy::Delay) {
+            set_paused(client, true);
+            timers_.schedule(client.throttle, (pass_time_us_ + wait + 999) / 1000);
+            return false;
+        }
+        if (config_.rate_policy == RatePolicy::Notify) {
+            if (client.throttle.scheduled()) {
+                ++client.throttled;
+            } else {
+                notify(client, "rate limit reached, message dropped");
+                timers_.schedule(client.throttle, pass_time_us_ / 1000 + 1000);
+            }
+        }
+        return false;
+    }
+
+    // A paused client's allowance has refilled: read on, starting with the
+    // frames already buffered. Otherwise reports what was dropped since the
+    // last notice.
+    void throttle_expired(Client& client) {
+        if (client.paused) {
+            set_paused(client, false);
+            if (client.shm) {
+                pump_shm(client);
+            } else {
+                process_input(client);
+            }
+            return;
+        }
+        if (client.throttled > 0) {
+            notify(client, std::to_string(client.throttled) + " more messages dropped by the rate limit");
+            client.throttled = 0;
+            timers_.schedule(client.throttle, pass_time_us_ / 1000 + 1000);
+        }
+    }
+
+    // Stops or resumes reading from a client, so TCP flow control holds back
+    // a sender that is over its limit. A shared-memory client's ring simply
+    // goes unread and fills up.
+    void set_paused(Client& client, bool paused) {
+        client.paused = paused;
+        if (client.shm) return;
+#ifdef CHAT_HAVE_IO_URING
+        if (ring_) {
+            if (paused && client.receiving) cancel_request(user_data(client.id, OP_RECV));
+            if (!paused && !client.receiving) arm_recv(client);
+            return;
+        }
+#endif
+        update_events(client);
+    }
+
+    void update_events(Client& client) {
+        epoll_event event{};
+        if (!client.paused) event.events |= EPOLLIN;
+        if (client.want_write) event.events |= EPOLLOUT;
+        event.data.u64 = client.id;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client.socket, &event);
+        LoopMetrics::add(metrics_.syscalls);
+    }
+
+    // Splits "/command argument rest" at the first two spaces
+    static void split_command(std::string_view payload, std::string_view& command,
+                              std::string_view& argument, std::string_view& rest) {
+        size_t space = payload.find(' ');
+        command = payload.substr(0, space);
+        argument = rest = std::string_view();
+        if (space == std::string_view::npos) return;
+        argument = payload.substr(space + 1);
+        space = argument.find(' ');
+        if (space != std::string_view::npos) {
+            rest = argument.substr(space + 1);
+            argument = argument.substr(0, space);
+        }
+    }
+
+    static bool valid_room_name(std::string_view room) {
+        return !room.empty() && room.size() <= MAX_ROOM_NAME_LENGTH;
+    }
+
+    // Sends a server notice to one client only
+    void notify(Client& client, std::string_view text) {
+        enqueue(client, SharedFrame::encode({ "*** ", text, " ***" }));
+    }
+
+    // Closes a client with a notice saying why. Its queue is discarded on
+    // close, so the notice is written straight away; the socket has taken
+    // nothing else yet, so one non-blocking send gets it there.
+    void turn_away(Client& client, std::string_view text) {
+        SharedFrame notice = SharedFrame::encode({ "*** ", text, " ***" });
+        if (client.shm) {
+            enqueue(client, notice);
+            flush_shm(client);
+            schedule_close(client);
+            return;
+        }
+        ssize_t ignored = send(client.socket, notice.data(), notice.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        (void)ignored;
+        LoopMetrics::add(metrics_.syscalls);
+        schedule_close(client);
+    }
+
+    void handle_command(Client& client, std::string_view payload) {
+        std::string_view command, argument, rest;
+        split_command(payload, command, argument, rest);
+        if (command == "/msg") {
+            send_direct(client, argument, rest);
+            return;
+        }
+        if (command == "/ping") {
+            enqueue(client, pong_frame_);
+            return;
+        }
+        if (command == "/pong") {
+            return;  // already counted as traffic
+        }
+        if (command != "/join" && command != "/leave" && command != "/post") {
+            notify(client, "unknown command");
+            return;
+        }
+        if (!valid_room_name(argument)) {
+            notify(client, "room names are 1 to 32 characters without spaces");
+            return;
+        }
+
+        std::string room(argument);
+        bool member = std::find(client.rooms.begin(), client.rooms.end(), room) != client.rooms.end();
+        if (command == "/join") {
+            if (member) return;
+            if (client.rooms.size() >= MAX_ROOMS_PER_CLIENT) {
+                notify(client, "too many rooms");
+                return;
+            }
+            rooms_.join(client, room);
+            notify(client, "joined " + room);
+        }
+        else if (command == "/leave") {
+            if (!member) return;
+            rooms_.leave(client, room);
+            notify(client, "left " + room);
+        }
+        else if (!member) {
+            notify(client, "join " + room + " before posting to it");
+        }
+        else {
+            SharedFrame frame = SharedFrame::encode({ "[", room, "] ", client.username, ": ", rest });
+            std::cout << frame.payload() << '\n';
+            broadcast(client, frame, room);
+        }
+    }
+
+    // Delivers here and hands the frame to every other loop; each of them
+    // looks up its own subscribers, so a room post costs the room's size.
+    // The loop where a message starts is the one that logs it.
+    void broadcast(const Client& sender, const SharedFrame& frame, const std::string& room = std::string()) {
+        if (log_) {
+            log_->append(frame, room.empty() ? ChatLog::Kind::Everyone : ChatLog::Kind::Room);
+        }
+        deliver_local(frame, sender.id, room);
+        for (size_t i = 0; i < reactors_.size(); ++i) {
+            if (static_cast<int>(i) != index_) {
+                outgoing_[i].push_back({ frame, sender.id, room });
+            }
+        }
+    }
+
+    // Looks the recipient up in the directory and queues the message for that
+    // client alone, here or through its loop's mailbox. Direct messages are
+    // neither logged nor kept in the history.
+    void send_direct(Client& sender, std::string_view recipient, std::string_view text) {
+        ClientId target = 0;
+        if (recipient.empty() || !users_.find(std::string(recipient), target)) {
+            notify(sender, "there is no user named " + std::string(recipient));
+            return;
+        }
+        SharedFrame frame = SharedFrame::encode({ sender.username, " (private): ", text });
+        int owner = static_cast<int>(target & (MAX_REACTORS - 1));
+        if (owner == index_) {
+            deliver_direct(frame, target);
+        } else {
+            outgoing_[owner].push_back({ frame, sender.id, std::string(), target });
+        }
+    }
+
+    void deliver_direct(const SharedFrame& frame, ClientId target) {
+        auto it = clients_.find(target);
+        if (it != clients_.end() && !it->second->closing) {
+            enqueue(*it->second, frame);
+        }
+    }
+
+    void deliver_local(const SharedFrame& frame, ClientId sender, const std::string& room) {
+        if (!room.empty()) {
+            if (const RoomIndex::Members* members = rooms_.members(room)) {
+                for (Client* client : *members) {
+                    if (client->id == sender || client->closing) continue;
+                    enqueue(*client, frame);
+                }
+            }
+            return;
+        }
+
+        history_.push(frame);
+        for (auto& [id, client] : clients_) {
+            if (id == sender || client->closing) continue;
+            enqueue(*client, frame);
+        }
+    }
+
+    // Periodic timer at TIMER_TICK_MS, so the wheel only has to look at the
+    // slots that came due since the last tick
+    bool start_timer() {
+        timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd_ == -1) return false;
+        itimerspec tick{};
+        tick.it_interval.tv_nsec = TIMER_TICK_MS * 1000000;
+        tick.it_value = tick.it_interval;
+        return timerfd_settime(timer_fd_, 0, &tick, nullptr) == 0;
+    }
+
+    void expire_timers() {
+        uint64_t ticks;
+        ssize_t ignored = read(timer_fd_, &ticks, sizeof(ticks));
+        (void)ignored;
+        LoopMetrics::add(metrics_.syscalls);
+        timers_.advance(pass_time_us_ / 1000, [this](TimerWheel::Timer& timer) {
+            auto it = clients_.find(timer.data);
+            if (it == clients_.end() || it->second->closing || it->second->handing_off) return;
+            if (&timer == &it->second->heartbeat) {
+                if (handoff_) {
+                    drain_client(*it->second);
+                } else {
+                    check_heartbeat(*it->second);
+                }
+            } else {
+                throttle_expired(*it->second);
+            }
+        });
+    }
+
+    // A client's deadline came due. A quiet client is pinged and gets
+    // heartbeat_timeout to answer; one that stayed silent after a ping, or
+    // never sent a username, is closed. Otherwise the deadline moves to
+    // heartbeat_interval after the last traffic.
+    void check_heartbeat(Client& client) {
+        uint64_t interval_us = config_.heartbeat_interval * 1000000ull;
+        uint64_t now = pass_time_us_;
+        if (client.pinged_us != 0 && client.heard_us < client.pinged_us) {
+            std::cout << (client.has_username ? client.username : "A client") << " timed out.\n";
+            LoopMetrics::add(metrics_.idle_disconnects);
+            schedule_close(client);
+            return;
+        }
+        client.pinged_us = 0;
+        if (now - client.heard_us < interval_us) {
+            timers_.schedule(client.heartbeat, (client.heard_us + interval_us) / 1000);
+            return;
+        }
+        if (!client.has_username) {
+            LoopMetrics::add(metrics_.idle_disconnects);
+            schedule_close(client);
+            return;
+        }
+        enqueue(client, ping_frame_);
+        client.pinged_us = now;
+        timers_.schedule(client.heartbeat, now / 1000 + config_.heartbeat_timeout * 1000ull);
+    }
+
+    // The new server has the listeners: stop accepting, and hand it the
+    // clients unless it only asked for the listeners. Shared-memory clients
+    // stay; their segment is mapped here. On io_uring a client is handed
+    // over once the requests that use its socket have been cancelled and
+    // have completed, so nothing here reads from or writes to it after.
+    void start_handoff(Handoff& handoff) {
+        handoff_ = &handoff;
+        log_ = nullptr;  // the log goes to the new server too
+        stop_accepting();
+        if (!handoff.wants_clients()) return;
+        for (auto& entry : clients_) {
+            Client& client = *entry.second;
+            if (client.closing || client.shm) continue;
+            client.handing_off = true;
+            ++handing_off_;
+#ifdef CHAT_HAVE_IO_URING
+            if (ring_) {
+                if (client.receiving) cancel_request(user_data(client.id, OP_RECV));
+                if (client.sending) cancel_request(user_data(client.id, OP_SEND));
+            }
+#endif
+            if (client.in_flight == 0) hand_off(client);
+        }
+    }
+
+    void stop_accepting() {
+#ifdef CHAT_HAVE_IO_URING
+        if (ring_) {
+            cancel_request(user_data(LISTENER_ID, OP_ACCEPT));
+            if (unix_socket_ != -1) cancel_request(user_data(UNIX_LISTENER_ID, OP_ACCEPT));
+        }
+#endif
+        if (epoll_fd_ != -1) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, server_socket_, nullptr);
+            if (unix_socket_ != -1) epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, unix_socket_, nullptr);
+        }
+        close(server_socket_);
+        server_socket_ = -1;
+        unix_socket_ = -1;
+    }
+
+    // Sends the client to the new server and closes it here without a word;
+    // the connection itself lives on over there. If the new server is gone,
+    // the client carries on here and is drained later.
+    void hand_off(Client& client) {
+        client.handing_off = false;
+        --handing_off_;
+        if (client.closing) return;  // failed while its requests were being cancelled
+        HandoffClient state;
+        state.has_username = client.has_username;
+        state.local = client.local;
+        state.username = client.username;
+        state.rooms = client.rooms;
+        state.input.assign(client.reader.buffered());
+        client.outbox.copy_unsent(state.output);
+        if (handoff_->send_client(state, client.socket)) {
+            schedule_close(client);
+            return;
+        }
+#ifdef CHAT_HAVE_IO_URING
+        if (ring_ && !client.paused && !client.receiving) arm_recv(client);
+#endif
+        process_input(client);  // bytes that arrived while the receive was being cancelled
+        if (!client.outbox.empty() && !client.flush_pending) {
+            client.flush_pending = true;
+            pending_flush_.push_back(&client);
+        }
+    }
+
+    // Every client this loop could hand over is gone: tell the upgrade
+    // thread, and spread closing the rest evenly over the drain period
+    void start_draining() {
+        draining_ = true;
+        handoff_->loop_finished();
+        uint64_t now_ms = pass_time_us_ / 1000;
+        uint64_t span_ms = config_.drain_seconds * 1000ull;
+        size_t count = 0;
+        for (auto& entry : clients_) {
+            if (!entry.second->closing) ++count;
+        }
+        size_t position = 0;
+        for (auto& entry : clients_) {
+            Client& client = *entry.second;
+            if (client.closing) continue;
+            timers_.schedule(client.heartbeat, now_ms + span_ms * position++ / count);
+        }
+    }
+
+    // A client that stays behind gets a notice, and a moment for it to
+    // arrive before the connection is closed
+    void drain_client(Client& client) {
+        if (client.leaving) {
+            schedule_close(client);
+            return;
+        }
+        notify(client, "server is restarting, please reconnect");
+        client.leaving = true;
+        timers_.schedule(client.heartbeat, pass_time_us_ / 1000 + 1000);
+    }
+
+    // Queues the recent messages for a client that just introduced itself,
+    // sharing the frames that were broadcast rather than encoding them again
+    void replay_history(Client& client) {
+        history_.for_each([&](const SharedFrame& frame) {
+            if (!client.closing) enqueue(client, frame);
+        });
+    }
+
+    void post_outgoing() {
+        for (size_t i = 0; i < outgoing_.size(); ++i) {
+            if (!outgoing_[i].empty() && reactors_[i]->mailbox_.post(outgoing_[i])) {
+                LoopMetrics::add(metrics_.syscalls);
+            }
+        }
+    }
+
+    void receive_deliveries() {
+        mailbox_.take(incoming_);
+        LoopMetrics::add(metrics_.syscalls);
+        for (const Delivery& delivery : incoming_) {
+            if (delivery.target != 0) {
+                deliver_direct(delivery.frame, delivery.target);
+            } else {
+                deliver_local(delivery.frame, delivery.sender, delivery.room);
+            }
+        }
+        incoming_.clear();
+    }
+
+    // Queues a frame for one client, applying the slow-consumer policy when
+    // its queue is already at the byte limit. The write itself happens once
+    // per event batch, so frames queued together leave in one sendmsg().
+    void enqueue(Client& client, const SharedFrame& frame) {
+        size_t before = client.outbox.bytes();
+        if (before + frame.size() > config_.queue_limit) {
+            switch (config_.slow_policy) {
+            case SlowConsumerPolicy::Drop:
+                ++client.dropped;
+                LoopMetrics::add(metrics_.dropped);
+                return;
+            case SlowConsumerPolicy::Disconnect:
+                std::cout << client.username << " is too slow, disconnecting.\n";
+                LoopMetrics::add(metrics_.slow_disconnects);
+                schedule_close(client);
+                return;
+            case SlowConsumerPolicy::Coalesce:
+                bool fits = client.outbox.make_room(frame.size(), config_.queue_limit);
+                queued_bytes_ += client.outbox.bytes() - before;
+                before = client.outbox.bytes();
+                if (!fits) {
+                    ++client.dropped;
+                    LoopMetrics::add(metrics_.dropped);
+                    return;
+                }
+                break;
+            }
+        }
+
+        client.outbox.push(frame, pass_time_us_);
+        queued_bytes_ += client.outbox.bytes() - before;
+        LoopMetrics::add(metrics_.frames_out);
+        if (!client.flush_pending && !client.want_write && !client.sending) {
+            client.flush_pending = true;
+            pending_flush_.push_back(&client);
+        }
+    }
+
+    void flush_pending() {
+        for (Client* client : pending_flush_) {
+            client->flush_pending = false;
+            if (client->closing) continue;
+#ifdef CHAT_HAVE_IO_URING
+            if (ring_ && !client->shm) {
+                submit_send(*client);
+                continue;
+            }
+#endif
+            flush(*client);
+        }
+        pending_flush_.clear();
+    }
+
+    // Writes as much of the queue as the socket accepts and asks for EPOLLOUT
+    // only while something is left over
+    void flush(Client& client) {
+        if (client.shm) {
+            flush_shm(client);
+            return;
+        }
+        uint64_t calls = 0;
+        size_t before = client.outbox.bytes();
+        uint64_t started = now_us();
+        uint64_t finished = 0;
+        OutboundQueue::FlushResult result = client.outbox.flush_to(client.socket, &calls, [&](uint64_t stamp) {
+            if (finished == 0) finished = now_us();
+            if (stamp != 0) metrics_.queue_time_us.record(finished - stamp);
+        });
+        if (calls > 0) {
+            metrics_.send_us.record((finished != 0 ? finished : now_us()) - started);
+        }
+        LoopMetrics::add(metrics_.syscalls, calls);
+        LoopMetrics::add(metrics_.bytes_out, before - client.outbox.bytes());
+        queued_bytes_ -= before - client.outbox.bytes();
+        if (result == OutboundQueue::FlushResult::Failed) {
+            schedule_close(client);
+            return;
+        }
+
+        bool has_backlog = !client.outbox.empty();
+        if (has_backlog != client.want_write) {
+            client.want_write = has_backlog;
+            update_events(client);
         }
     }
 
-    close(server_socket);
+    // Copies as much of the queue into the client's ring as fits. When the
+    // ring is full, the client rings the doorbell once it has made room.
+    void flush_shm(Client& client) {
+        ShmRing out = client.shm->to_client();
+        size_t before = client.outbox.bytes();
+        uint64_t finished = now_us();
+        while (!client.outbox.empty()) {
+            iovec iov[OutboundQueue::MAX_IOV];
+            size_t requested = 0;
+            size_t count = client.outbox.gather(iov, OutboundQueue::MAX_IOV, requested);
+            size_t written = out.write(iov, count);
+            if (written == 0) {
+                if (out.producer_sleep()) break;
+                continue;
+            }
+            client.outbox.consume(written, [&](uint64_t stamp) {
+                if (stamp != 0) metrics_.queue_time_us.record(finished - stamp);
+            });
+        }
+        size_t written = before - client.outbox.bytes();
+        LoopMetrics::add(metrics_.bytes_out, written);
+        queued_bytes_ -= written;
+        if (written > 0 && out.wake_consumer()) {
+            ring_doorbell(client.socket);
+            LoopMetrics::add(metrics_.syscalls);
+        }
+    }
+
+    // Sockets are closed after the current batch of events so that no event
+    // still in flight refers to a destroyed client
+    void schedule_close(Client& client) {
+        if (!client.closing) {
+            client.closing = true;
+            pending_close_.push_back(client.id);
+        }
+    }
+
+    void close_pending() {
+        for (ClientId id : pending_close_) {
+            auto it = clients_.find(id);
+            Client& client = *it->second;
+            rooms_.leave_all(client);
+            timers_.cancel(client.heartbeat);
+            timers_.cancel(client.throttle);
+            if (client.has_username) {
+                users_.release(client.username, client.id);
+            }
+            client.unlisted = true;
+            queued_bytes_ -= client.outbox.bytes();
+            LoopMetrics::add(metrics_.closed);
+            // io_uring requests still in flight point at the client; shutting
+            // the socket down makes them complete, and the last one frees it
+            if (client.in_flight > 0) {
+                shutdown(client.socket, SHUT_RDWR);
+                continue;
+            }
+            if (epoll_fd_ != -1) {
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, client.socket, nullptr);
+            }
+            close(client.socket);
+            clients_.erase(it);
+        }
+        pending_close_.clear();
+    }
+
+#ifdef CHAT_HAVE_IO_URING
+    // What an io_uring request was for, kept in the low bits of user_data
+    enum UringOp : uint64_t { OP_ACCEPT, OP_MAILBOX, OP_RECV, OP_SEND, OP_TIMER };
+    static const int URING_OP_BITS = 3;
+
+    std::unique_ptr<IoUring> ring_;
+
+    static uint64_t user_data(ClientId id, UringOp op) {
+        return (id << URING_OP_BITS) | op;
+    }
+
+    // Completions are drained and handled in batches; every request they
+    // trigger, and every send queued while handling them, goes to the kernel
+    // in the next single io_uring_enter() that also waits for more
+    void run_uring() {
+        arm_accept(LISTENER_ID);
+        if (unix_socket_ != -1) arm_accept(UNIX_LISTENER_ID);
+        arm_mailbox();
+        if (timer_fd_ != -1) arm_timer();
+        while (true) {
+            uint64_t enters_before = ring_->enters();
+            int result = ring_->submit_and_wait(1);
+            if (result < 0 && (ring_->failed() || (result != -EINTR && result != -EBUSY))) {
+                std::cerr << "io_uring_enter failed: " << strerror(-result) << "\n";
+                return;
+            }
+            pass_time_us_ = now_us();
+            ring_->drain_completions([this](const io_uring_cqe& cqe) { handle_completion(cqe); });
+            end_pass();
+            LoopMetrics::add(metrics_.syscalls, ring_->enters() - enters_before);
+        }
+    }
+
+    // One request keeps producing accepted sockets until the kernel ends it
+    void arm_accept(ClientId listener) {
+        io_uring_sqe* sqe = ring_->get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener == UNIX_LISTENER_ID ? unix_socket_ : server_socket_;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = user_data(listener, OP_ACCEPT);
+    }
+
+    void arm_mailbox() {
+        io_uring_sqe* sqe = ring_->get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = mailbox_.fd();
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = user_data(MAILBOX_ID, OP_MAILBOX);
+    }
+
+    void arm_timer() {
+        io_uring_sqe* sqe = ring_->get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = timer_fd_;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = user_data(TIMER_ID, OP_TIMER);
+    }
+
+    // Multishot receive into buffers the kernel picks from the provided pool
+    void arm_recv(Client& client) {
+        io_uring_sqe* sqe = ring_->get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = client.socket;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = ring_->buffer_group();
+        sqe->user_data = user_data(client.id, OP_RECV);
+        client.receiving = true;
+        ++client.in_flight;
+    }
+
+    // Ends the request with this user_data; it completes with -ECANCELED,
+    // or with what it had done so far
+    void cancel_request(uint64_t target) {
+        io_uring_sqe* sqe = ring_->get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = target;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = IoUring::INTERNAL;
+    }
+
+    // Starts one gathered sendmsg for whatever is queued; the next starts when
+    // this one completes, so frames queued meanwhile go out together
+    void submit_send(Client& client) {
+        if (client.sending || client.closing || client.handing_off || client.outbox.empty()) return;
+        if (!client.send_state) {
+            client.send_state = std::make_unique<Client::SendState>();
+        }
+        Client::SendState& state = *client.send_state;
+        size_t bytes = 0;
+        state.message = msghdr{};
+        state.message.msg_iov = state.iov;
+        state.message.msg_iovlen = client.outbox.gather(state.iov, OutboundQueue::MAX_IOV, bytes);
+        client.outbox.pin(state.message.msg_iovlen);
+        state.started_us = now_us();
+
+        io_uring_sqe* sqe = ring_->get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = client.socket;
+        sqe->addr = reinterpret_cast<uint64_t>(&state.message);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data(client.id, OP_SEND);
+        client.sending = true;
+        ++client.in_flight;
+    }
+
+    void handle_completion(const io_uring_cqe& cqe) {
+        UringOp op = static_cast<UringOp>(cqe.user_data & ((1u << URING_OP_BITS) - 1));
+        ClientId id = cqe.user_data >> URING_OP_BITS;
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        if (op == OP_ACCEPT) {
+            if (cqe.res >= 0) {
+                arm_recv(adopt_client(next_client_id(), cqe.res, id == UNIX_LISTENER_ID));
+            } else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED && cqe.res != -ECANCELED) {
+                std::cerr << "accept failed: " << strerror(-cqe.res) << "\n";
+            }
+            if (!more && !handoff_) arm_accept(id);
+            return;
+        }
+        if (op == OP_MAILBOX) {
+            receive_deliveries();
+            if (!more) arm_mailbox();
+            return;
+        }
+        if (op == OP_TIMER) {
+            expire_timers();
+            if (!more) arm_timer();
+            return;
+        }
+
+        auto it = clients_.find(id);
+        if (it == clients_.end()) return;
+        Client& client = *it->second;
+        if (!more) --client.in_flight;
+
+        if (op == OP_RECV) {
+            if (!more) client.receiving = false;
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uint16_t buffer = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (cqe.res > 0 && !client.closing && !client.shm) {
+                    client.reader.append(ring_->buffer(buffer), cqe.res);
+                    LoopMetrics::add(metrics_.bytes_in, cqe.res);
+                }
+                ring_->recycle_buffer(buffer);
+            }
+            // A shared-memory client's socket is read for doorbells even
+            // while its ring is paused
+            auto rearm = [&] {
+                if (!more && !client.closing && (!client.paused || client.shm)) arm_recv(client);
+            };
+            if (client.handing_off) {
+                // Bytes that raced the cancel stay in the reader and go
+                // along with the client
+            } else if (cqe.res > 0) {
+                if (client.shm) {
+                    pump_shm(client);
+                } else {
+                    process_input(client);
+                }
+                rearm();
+            } else if (cqe.res == -ENOBUFS || cqe.res == -ECANCELED) {
+                // Every buffer was taken, and they are recycled as their
+                // completions are handled; or a pause cancelled the
+                // receive and has ended since. Either way, ask again.
+                rearm();
+            } else if (!client.closing) {
+                disconnected(client);
+            }
+        } else if (op == OP_SEND) {
+            client.sending = false;
+            if (cqe.res < 0) {
+                client.outbox.pin(0);
+                if (cqe.res != -ECANCELED || !client.handing_off) schedule_close(client);
+            } else {
+                uint64_t finished = now_us();
+                metrics_.send_us.record(finished - client.send_state->started_us);
+                client.outbox.consume(cqe.res, [&](uint64_t stamp) {
+                    if (stamp != 0) metrics_.queue_time_us.record(finished - stamp);
+                });
+                LoopMetrics::add(metrics_.bytes_out, cqe.res);
+                // Once closed, the client's remaining bytes are already off the gauge
+                if (!client.unlisted) queued_bytes_ -= cqe.res;
+                submit_send(client);
+            }
+        }
+
+        if (client.handing_off && client.in_flight == 0) {
+            hand_off(client);
+        }
+        if (client.unlisted && client.in_flight == 0) {
+            close(client.socket);
+            clients_.erase(it);
+        }
+    }
+#endif
+};
 
-#ifdef _WIN32
-    WSACleanup();
+// Whether this build and this kernel can run the io_uring backend
+bool io_uring_available() {
+#ifdef CHAT_HAVE_IO_URING
+    IoUring probe;
+    return probe.init(8) && probe.provide_buffers(URING_BUFFER_GROUP, 8, RECEIVE_CHUNK);
+#else
+    return false;
 #endif
+}
+
+// Prints syscalls and frames per interval, summed over the event loops, so
+// the backends can be compared under the same benchmark
+void report_io_stats(const std::vector<std::unique_ptr<Reactor>>& reactors, const ServerConfig& config,
+                     const ChatLog* log) {
+    uint64_t last_syscalls = 0, last_in = 0, last_out = 0, last_logged = 0, last_syncs = 0;
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(config.stats_interval));
+        uint64_t syscalls = 0, frames_in = 0, frames_out = 0;
+        for (const auto& reactor : reactors) {
+            syscalls += reactor->metrics().syscalls.load(std::memory_order_relaxed);
+            frames_in += reactor->metrics().frames_in.load(std::memory_order_relaxed);
+            frames_out += reactor->metrics().frames_out.load(std::memory_order_relaxed);
+        }
+        uint64_t delta_syscalls = syscalls - last_syscalls;
+        uint64_t delta_frames = (frames_in - last_in) + (frames_out - last_out);
+        std::cerr << "io=" << (config.io == IoBackend::Uring ? "uring" : "epoll")
+                  << " syscalls=" << delta_syscalls
+                  << " frames_in=" << frames_in - last_in
+                  << " frames_out=" << frames_out - last_out
+                  << " syscalls_per_frame=" << (delta_frames ? double(delta_syscalls) / delta_frames : 0.0);
+        if (log) {
+            uint64_t logged = log->stats().records.load(std::memory_order_relaxed);
+            uint64_t syncs = log->stats().syncs.load(std::memory_order_relaxed);
+            std::cerr << " logged=" << logged - last_logged << " log_syncs=" << syncs - last_syncs
+                      << " log_dropped=" << log->stats().dropped.load(std::memory_order_relaxed);
+            last_logged = logged;
+            last_syncs = syncs;
+        }
+        std::cerr << "\n";
+        last_syscalls = syscalls;
+        last_in = frames_in;
+        last_out = frames_out;
+    }
+}
+
+// Rewrites the metrics file every interval with totals over all event loops
+// since the server started. The file is replaced atomically, so readers
+// never see half of it.
+void dump_metrics(const std::vector<std::unique_ptr<Reactor>>& reactors, const ServerConfig& config,
+                  const ChatLog* log) {
+    uint64_t started = now_us();
+    std::string temporary = config.metrics_file + ".tmp";
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(config.metrics_interval));
+
+        uint64_t syscalls = 0, accepted = 0, closed = 0, frames_in = 0, bytes_in = 0;
+        uint64_t frames_out = 0, bytes_out = 0, dropped = 0, slow_disconnects = 0, idle_disconnects = 0;
+        uint64_t rate_limited = 0, queued_bytes = 0, uring_buffers_lost = 0;
+        LatencyHistogram queue_time, send_time;
+        for (const auto& reactor : reactors) {
+            const LoopMetrics& metrics = reactor->metrics();
+            syscalls += metrics.syscalls.load(std::memory_order_relaxed);
+            accepted += metrics.accepted.load(std::memory_order_relaxed);
+            closed += metrics.closed.load(std::memory_order_relaxed);
+            frames_in += metrics.frames_in.load(std::memory_order_relaxed);
+            bytes_in += metrics.bytes_in.load(std::memory_order_relaxed);
+            frames_out += metrics.frames_out.load(std::memory_order_relaxed);
+            bytes_out += metrics.bytes_out.load(std::memory_order_relaxed);
+            dropped += metrics.dropped.load(std::memory_order_relaxed);
+            slow_disconnects += metrics.slow_disconnects.load(std::memory_order_relaxed);
+            idle_disconnects += metrics.idle_disconnects.load(std::memory_order_relaxed);
+            rate_limited += metrics.rate_limited.load(std::memory_order_relaxed);
+            queued_bytes += metrics.queued_bytes.load(std::memory_order_relaxed);
+            uring_buffers_lost += metrics.uring_buffers_lost.load(std::memory_order_relaxed);
+            metrics.queue_time_us.merge_into(queue_time);
+            metrics.send_us.merge_into(send_time);
+        }
+
+        FILE* out = std::fopen(temporary.c_str(), "w");
+        if (!out) {
+            std::cerr << "Cannot write metrics to " << temporary << ": " << strerror(errno) << "\n";
+            continue;
+        }
+        auto line = [out](const char* name, uint64_t value) {
+            std::fprintf(out, "%s %llu\n", name, static_cast<unsigned long long>(value));
+        };
+        auto histogram = [&](const std::string& name, const LatencyHistogram& values) {
+            line((name + "_count").c_str(), values.count());
+            line((name + "_p50").c_str(), values.percentile(0.50));
+            line((name + "_p99").c_str(), values.percentile(0.99));
+            line((name + "_p999").c_str(), values.percentile(0.999));
+            line((name + "_max").c_str(), values.max());
+        };
+        line("uptime_seconds", (now_us() - started) / 1000000);
+        line("event_loops", reactors.size());
+        line("connections_open", accepted - closed);
+        line("connections_accepted", accepted);
+        line("connections_closed", closed);
+        line("frames_in", frames_in);
+        line("bytes_in", bytes_in);
+        line("frames_out", frames_out);
+        line("bytes_out", bytes_out);
+        line("queued_bytes", queued_bytes);
+        line("dropped_messages", dropped);
+        line("slow_disconnects", slow_disconnects);
+        line("idle_disconnects", idle_disconnects);
+        line("rate_limited_messages", rate_limited);
+        line("syscalls", syscalls);
+        line("uring_buffers_lost", uring_buffers_lost);
+        histogram("queue_time_us", queue_time);
+        histogram("send_us", send_time);
+        if (log) {
+            line("log_records", log->stats().records.load(std::memory_order_relaxed));
+            line("log_syncs", log->stats().syncs.load(std::memory_order_relaxed));
+            line("log_dropped", log->stats().dropped.load(std::memory_order_relaxed));
+        }
+        bool written = std::fclose(out) == 0;
+        if (!written || std::rename(temporary.c_str(), config.metrics_file.c_str()) != 0) {
+            std::cerr << "Cannot write metrics to " << config.metrics_file << ": " << strerror(errno) << "\n";
+        }
+    }
+}
+
+// Waits on the upgrade socket for the server that replaces this one. Once
+// one has the listeners, the event loops hand it their clients; this
+// thread then passes on the log, lets the loops drain whatever stayed
+// behind, and ends the process. A successor that goes away before it has
+// the listeners changes nothing, and the next one may try again. Only a
+// process running as the same user may take over.
+void serve_upgrades(const std::vector<std::unique_ptr<Reactor>>& reactors, const ServerConfig& config,
+                    int control, int unix_listener, ChatLog* log) {
+    int socket = -1;
+    bool clients = false;
+    while (socket == -1) {
+        pollfd ready{ control, POLLIN, 0 };
+        if (poll(&ready, 1, -1) < 0) continue;
+        socket = accept4(control, nullptr, nullptr, SOCK_CLOEXEC);
+        if (socket == -1) continue;
+        ucred peer{};
+        socklen_t peer_size = sizeof(peer);
+        if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) < 0 || peer.uid != geteuid()) {
+            std::cerr << "Refused an upgrade from a process of another user.\n";
+            close(socket);
+            socket = -1;
+            continue;
+        }
+        std::string request;
+        int fd = -1;
+        bool sent = receive_frame_with_fd(socket, request, fd) &&
+                    (request == "takeover clients" || request == "takeover listeners");
+        if (fd != -1) close(fd);
+        for (const auto& reactor : reactors) {
+            sent = sent && send_frame_with_fd(socket, "listener tcp", reactor->listener());
+        }
+        if (sent && unix_listener != -1) {
+            sent = send_frame_with_fd(socket, "listener unix", unix_listener);
+        }
+        if (!sent) {
+            close(socket);
+            socket = -1;
+        }
+        clients = request == "takeover clients";
+    }
+    close(control);
+
+    std::cout << "A new server has taken over the listeners, handing over.\n";
+    Handoff handoff(socket, clients, reactors.size());
+    for (const auto& reactor : reactors) {
+        reactor->begin_handoff(handoff);
+    }
+    size_t handed = handoff.wait();
+    if (log) {
+        log->close();
+    }
+    send_frame_with_fd(socket, "done", -1);
+    close(socket);
+    std::cout << "Handed over " << handed << " clients, draining the rest.\n";
+
+    // The loops close the last clients over the drain period; leave some
+    // time after it for their notices to go out
+    uint64_t deadline = now_us() + (config.drain_seconds + 2) * 1000000ull;
+    while (now_us() < deadline) {
+        uint64_t open = 0;
+        for (const auto& reactor : reactors) {
+            open += reactor->metrics().accepted.load(std::memory_order_relaxed) -
+                    reactor->metrics().closed.load(std::memory_order_relaxed);
+        }
+        if (open == 0) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::cout << "Drained, exiting.\n" << std::flush;
+    _exit(0);
+}
+
+// What a starting server got from the one it replaces
+struct Takeover {
+    std::vector<int> listeners;  // one per event loop of the old server
+    int unix_listener = -1;
+    std::vector<std::pair<int, HandoffClient>> clients;
+};
+
+// Connects to the running server's upgrade socket and takes over its
+// listeners, and its clients when asked to. Returns once the old server is
+// done, and has closed its log, or has gone away; false if not even the
+// listeners arrived.
+bool take_over(const ServerConfig& config, Takeover& takeover) {
+    sockaddr_un address{};
+    if (config.takeover_path.size() >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket == -1) {
+        return false;
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, config.takeover_path.c_str(), config.takeover_path.size() + 1);
+    if (connect(socket, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        !send_frame_with_fd(socket, config.handoff_clients ? "takeover clients" : "takeover listeners", -1)) {
+        close(socket);
+        return false;
+    }
+
+    bool done = false;
+    std::string payload;
+    int fd = -1;
+    while (receive_frame_with_fd(socket, payload, fd, MAX_HANDOFF_FRAME)) {
+        if (payload == "done") {
+            done = true;
+            break;
+        }
+        if (fd == -1) continue;
+        HandoffClient client;
+        if (payload == "listener tcp") {
+            takeover.listeners.push_back(fd);
+        } else if (payload == "listener unix" && takeover.unix_listener == -1) {
+            takeover.unix_listener = fd;
+        } else if (decode_handoff_client(payload, client)) {
+            takeover.clients.emplace_back(fd, std::move(client));
+        } else {
+            close(fd);
+        }
+    }
+    if (fd != -1 && !done) {
+        close(fd);  // came with a frame that was cut short
+    }
+    close(socket);
+    if (!done && !takeover.listeners.empty()) {
+        std::cerr << "The old server went away during the handoff; carrying on with what arrived.\n";
+    }
+    return !takeover.listeners.empty();
+}
+
+bool parse_args(int argc, char** argv, ServerConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << "\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--port") {
+            config.port = std::atoi(value.c_str());
+        }
+        else if (arg == "--threads") {
+            config.threads = std::atoi(value.c_str());
+        }
+        else if (arg == "--queue-limit") {
+            config.queue_limit = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--io") {
+            if (value == "epoll") config.io = IoBackend::Epoll;
+            else if (value == "uring") config.io = IoBackend::Uring;
+            else {
+                std::cerr << "Unknown I/O backend " << value << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--history") {
+            config.history_messages = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--history-bytes") {
+            config.history_bytes = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--unix") {
+            config.unix_path = value;
+        }
+        else if (arg == "--log-dir") {
+            config.log_dir = value;
+        }
+        else if (arg == "--log-segment-bytes") {
+            config.log_segment_bytes = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--metrics-file") {
+            config.metrics_file = value;
+        }
+        else if (arg == "--metrics-interval") {
+            config.metrics_interval = std::atoi(value.c_str());
+        }
+        else if (arg == "--heartbeat") {
+            config.heartbeat_interval = std::atoi(value.c_str());
+        }
+        else if (arg == "--heartbeat-timeout") {
+            config.heartbeat_timeout = std::atoi(value.c_str());
+        }
+        else if (arg == "--rate-limit") {
+            config.rate_messages = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--rate-limit-bytes") {
+            config.rate_bytes = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--rate-burst") {
+            config.rate_burst = std::atoi(value.c_str());
+        }
+        else if (arg == "--rate-policy") {
+            if (value == "delay") config.rate_policy = RatePolicy::Delay;
+            else if (value == "drop") config.rate_policy = RatePolicy::Drop;
+            else if (value == "notify") config.rate_policy = RatePolicy::Notify;
+            else {
+                std::cerr << "Unknown rate limit policy " << value << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--upgrade-socket") {
+            config.upgrade_path = value;
+        }
+        else if (arg == "--takeover") {
+            config.takeover_path = value;
+        }
+        else if (arg == "--handoff") {
+            if (value == "clients") config.handoff_clients = true;
+            else if (value == "listeners") config.handoff_clients = false;
+            else {
+                std::cerr << "Unknown handoff mode " << value << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--drain") {
+            config.drain_seconds = std::atoi(value.c_str());
+        }
+        else if (arg == "--stats-interval") {
+            config.stats_interval = std::atoi(value.c_str());
+        }
+        else if (arg == "--slow-policy") {
+            if (value == "drop") config.slow_policy = SlowConsumerPolicy::Drop;
+            else if (value == "disconnect") config.slow_policy = SlowConsumerPolicy::Disconnect;
+            else if (value == "coalesce") config.slow_policy = SlowConsumerPolicy::Coalesce;
+            else {
+                std::cerr << "Unknown slow consumer policy " << value << "\n";
+                return false;
+            }
+        }
+        else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return false;
+        }
+    }
+    return config.port > 0 && config.queue_limit > 0 && config.threads > 0 && config.threads <= MAX_REACTORS &&
+           config.stats_interval >= 0 && config.metrics_interval > 0 && config.log_segment_bytes > 0 && config.log_segment_bytes < (1ull << 32) &&
+           config.heartbeat_interval >= 0 && config.heartbeat_timeout > 0 && config.rate_burst > 0 &&
+           config.drain_seconds >= 0;
+}
 
+int main(int argc, char** argv) {
+    ServerConfig config;
+    if (!parse_args(argc, argv, config)) {
+        std::cerr << "Usage: ChatServer [--port P] [--unix PATH] [--threads N] [--queue-limit BYTES]\n"
+                     "                  [--slow-policy drop|disconnect|coalesce]\n"
+                     "                  [--io epoll|uring] [--stats-interval SECONDS]\n"
+                     "                  [--history MESSAGES] [--history-bytes BYTES]\n"
+                     "                  [--log-dir DIR] [--log-segment-bytes BYTES]\n"
+                     "                  [--metrics-file PATH] [--metrics-interval SECONDS]\n"
+                     "                  [--heartbeat SECONDS] [--heartbeat-timeout SECONDS]\n"
+                     "                  [--rate-limit MESSAGES] [--rate-limit-bytes BYTES]\n"
+                     "                  [--rate-burst SECONDS] [--rate-policy delay|drop|notify]\n"
+                     "                  [--upgrade-socket PATH] [--drain SECONDS]\n"
+                     "                  [--takeover PATH] [--handoff clients|listeners]\n";
+        return 1;
+    }
+    if (config.io == IoBackend::Uring && !io_uring_available()) {
+        std::cerr << "io_uring is not available here, using epoll.\n";
+        config.io = IoBackend::Epoll;
+    }
+
+    // The old server closes the log before it is done, so the log is
+    // opened after the takeover
+    Takeover takeover;
+    if (!config.takeover_path.empty()) {
+        if (!take_over(config, takeover)) {
+            std::cerr << "Failed to take over from " << config.takeover_path << ": " << strerror(errno) << "\n";
+            return -1;
+        }
+        if (static_cast<int>(takeover.listeners.size()) != config.threads) {
+            std::cout << "Taking over " << takeover.listeners.size() << " listeners, one per event loop.\n";
+        }
+        config.threads = static_cast<int>(std::min<size_t>(takeover.listeners.size(), MAX_REACTORS));
+    }
+
+    std::unique_ptr<ChatLog> log;
+    if (!config.log_dir.empty()) {
+        ChatLog::Options options;
+        options.directory = config.log_dir;
+        options.segment_bytes = config.log_segment_bytes;
+        log = std::make_unique<ChatLog>(options);
+        if (!log->open()) {
+            return -1;
+        }
+    }
+
+    UserDirectory users;
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    for (int i = 0; i < config.threads; ++i) {
+        reactors.push_back(std::make_unique<Reactor>(i, config, reactors, log.get(), users));
+    }
+
+    // A restarted server picks up the history where the log left off
+    if (log && config.history_messages > 0) {
+        uint64_t end = log->next_offset();
+        uint64_t from = end > config.history_messages ? end - config.history_messages : 0;
+        log->read_from(from, [&](uint64_t, ChatLog::Kind kind, std::string_view payload) {
+            if (kind != ChatLog::Kind::Everyone) return;
+            SharedFrame frame = SharedFrame::encode({ payload });
+            for (auto& reactor : reactors) {
+                reactor->seed_history(frame);
+            }
+        });
+    }
+    int unix_listener = takeover.unix_listener;
+    if (unix_listener == -1 && !config.unix_path.empty()) {
+        unix_listener = open_unix_listener(config.unix_path);
+        if (unix_listener == -1) {
+            std::cerr << "Failed to listen on " << config.unix_path << ": " << strerror(errno) << "\n";
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < reactors.size(); ++i) {
+        if (!reactors[i]->start(unix_listener, takeover.listeners.empty() ? -1 : takeover.listeners[i])) {
+            std::cerr << "Failed to listen on port " << config.port << ": " << strerror(errno) << "\n";
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < takeover.clients.size(); ++i) {
+        int client_socket = takeover.clients[i].first;
+        if (!reactors[i % reactors.size()]->restore_client(client_socket, takeover.clients[i].second)) {
+            close(client_socket);
+        }
+    }
+    if (!config.takeover_path.empty()) {
+        std::cout << "Took over " << takeover.clients.size() << " clients.\n";
+    }
+
+    if (!config.upgrade_path.empty()) {
+        int control = open_unix_listener(config.upgrade_path, true);
+        if (control == -1) {
+            std::cerr << "Failed to listen on " << config.upgrade_path << ": " << strerror(errno) << "\n";
+            return -1;
+        }
+        std::thread(serve_upgrades, std::cref(reactors), std::cref(config), control, unix_listener, log.get()).detach();
+    }
+
+    std::cout << "Server started on port " << config.port << " with " << config.threads
+              << " event loops on " << (config.io == IoBackend::Uring ? "io_uring" : "epoll")
+              << ". Waiting for connections...\n";
+
+    if (config.stats_interval > 0) {
+        std::thread(report_io_stats, std::cref(reactors), std::cref(config), log.get()).detach();
+    }
+    if (!config.metrics_file.empty()) {
+        std::thread(dump_metrics, std::cref(reactors), std::cref(config), log.get()).detach();
+    }
+
+    // The first loop runs on the main thread
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < reactors.size(); ++i) {
+        threads.emplace_back(&Reactor::run, reactors[i].get());
+    }
+    reactors[0]->run();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
     return 0;
 }
@@ -0,0 +1,365 @@
+﻿#pragma once
+
+// Shared-memory transport for clients on the same host as the server. A
+// client connected over the server's Unix socket may send "/shm" as its very
+// first frame; the server answers with a "/shm" frame that carries a memfd.
+// The memfd holds two single-producer single-consumer byte rings, one per
+// direction, which carry exactly the bytes the socket would: the same
+// frames, in the same order, with the same commands.
+//
+// The socket stays open as a doorbell. A side that finds its ring empty
+// says so in the ring and blocks on the socket, and the other side writes a
+// single byte to the socket only then, so a busy connection moves messages
+// without syscalls. Closing the socket still ends the session.
+
+#ifdef __linux__
+#define CHAT_HAVE_SHM 1
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <new>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "ChatProtocol.h"
+
+// Bytes per direction; a power of two
+const size_t SHM_RING_CAPACITY = 1 << 20;
+
+// Positions are running byte counts, so head == tail means empty and the
+// ring never needs a spare slot. Each field has its own cache line because
+// the two sides write different ones.
+struct ShmRingControl {
+    alignas(64) std::atomic<uint64_t> head{ 0 };  // bytes consumed, written by the consumer
+    alignas(64) std::atomic<uint64_t> tail{ 0 };  // bytes produced, written by the producer
+    alignas(64) std::atomic<uint32_t> consumer_waiting{ 0 };
+    std::atomic<uint32_t> producer_waiting{ 0 };
+};
+
+// View of one ring in the shared segment
+class ShmRing {
+public:
+    ShmRing() = default;
+    ShmRing(char* base, size_t capacity)
+        : control_(reinterpret_cast<ShmRingControl*>(base)), data_(base + sizeof(ShmRingControl)),
+          capacity_(capacity) {}
+
+    // Consumer side
+    size_t readable() const {
+        return control_->tail.load(std::memory_order_acquire) - control_->head.load(std::memory_order_relaxed);
+    }
+
+    // Producer: copies as much of `iov` as fits and publishes it at once
+    size_t write(const iovec* iov, size_t count) {
+        uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+        size_t room = capacity_ - (tail - control_->head.load(std::memory_order_acquire));
+        size_t written = 0;
+        for (size_t i = 0; i < count && room > 0; ++i) {
+            size_t chunk = std::min(iov[i].iov_len, room);
+            copy_in(tail + written, static_cast<const char*>(iov[i].iov_base), chunk);
+            written += chunk;
+            room -= chunk;
+        }
+        if (written > 0) control_->tail.store(tail + written, std::memory_order_release);
+        return written;
+    }
+
+    size_t write(const char* data, size_t size) {
+        iovec one{ const_cast<char*>(data), size };
+        return write(&one, 1);
+    }
+
+    // Consumer: copies up to `size` bytes out and frees their space
+    size_t read(char* out, size_t size) {
+        uint64_t head = control_->head.load(std::memory_order_relaxed);
+        size = std::min(size, static_cast<size_t>(control_->tail.load(std::memory_order_acquire) - head));
+        size_t offset = head & (capacity_ - 1);
+        size_t first = std::min(size, capacity_ - offset);
+        std::memcpy(out, data_ + offset, first);
+        std::memcpy(out + first, data_, size - first);
+        if (size > 0) control_->head.store(head + size, std::memory_order_release);
+        return size;
+    }
+
+    // Consumer, before blocking on the doorbell. Returns false, and stays
+    // awake, if data arrived in the meantime.
+    bool consumer_sleep() {
+        return go_to_sleep(control_->consumer_waiting, [this] { return readable() > 0; });
+    }
+
+    // Producer, after a write: true if the consumer is asleep and must be
+    // woken with the doorbell
+    bool wake_consumer() { return wake(control_->consumer_waiting); }
+
+    // The same pair for a producer waiting for room
+    bool producer_sleep() {
+        return go_to_sleep(control_->producer_waiting, [this] {
+            return control_->tail.load(std::memory_order_relaxed) -
+                   control_->head.load(std::memory_order_acquire) < capacity_;
+        });
+    }
+
+    bool wake_producer() { return wake(control_->producer_waiting); }
+
+private:
+    ShmRingControl* control_ = nullptr;
+    char* data_ = nullptr;
+    size_t capacity_ = 0;
+
+    void copy_in(uint64_t position, const char* data, size_t size) {
+        size_t offset = position & (capacity_ - 1);
+        size_t first = std::min(size, capacity_ - offset);
+        std::memcpy(data_ + offset, data, first);
+        std::memcpy(data_, data + first, size - first);
+    }
+
+    // The flag store and the re-check on one side, and the position store
+    // and the flag check on the other, are each ordered by a full fence, so
+    // either the sleeper sees the new data or the other side sees the flag
+    template <typename Ready>
+    static bool go_to_sleep(std::atomic<uint32_t>& waiting, Ready&& ready) {
+        waiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready()) {
+            waiting.store(0, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    static bool wake(std::atomic<uint32_t>& waiting) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return waiting.load(std::memory_order_relaxed) != 0 && waiting.exchange(0) != 0;
+    }
+};
+
+// The mapped memfd: the client-to-server ring, then the server-to-client one
+class ShmSegment {
+public:
+    ShmSegment() = default;
+
+    ~ShmSegment() {
+        if (base_) munmap(base_, size_);
+    }
+
+    ShmSegment(const ShmSegment&) = delete;
+    ShmSegment& operator=(const ShmSegment&) = delete;
+
+    // Server: creates and maps a fresh segment. Returns its memfd for handing
+    // to the client, which the caller closes afterwards, or -1.
+    int create(size_t capacity) {
+        int fd = memfd_create("chat-shm", MFD_CLOEXEC);
+        if (fd == -1) return -1;
+        if (ftruncate(fd, segment_size(capacity)) < 0 || !map_fd(fd, capacity)) {
+            close(fd);
+            return -1;
+        }
+        new (base_) ShmRingControl();
+        new (base_ + sizeof(ShmRingControl) + capacity) ShmRingControl();
+        return fd;
+    }
+
+    // Client: maps the segment the server sent
+    bool map(int fd) {
+        struct stat info;
+        if (fstat(fd, &info) < 0 || info.st_size <= static_cast<off_t>(2 * sizeof(ShmRingControl))) return false;
+        size_t capacity = static_cast<size_t>(info.st_size) / 2 - sizeof(ShmRingControl);
+        if ((capacity & (capacity - 1)) != 0 || segment_size(capacity) != static_cast<size_t>(info.st_size)) return false;
+        return map_fd(fd, capacity);
+    }
+
+    ShmRing to_server() const { return ShmRing(base_, capacity_); }
+    ShmRing to_client() const { return ShmRing(base_ + sizeof(ShmRingControl) + capacity_, capacity_); }
+
+private:
+    char* base_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+
+    static size_t segment_size(size_t capacity) { return 2 * (sizeof(ShmRingControl) + capacity); }
+
+    bool map_fd(int fd, size_t capacity) {
+        void* base = mmap(nullptr, segment_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) return false;
+        base_ = static_cast<char*>(base);
+        size_ = segment_size(capacity);
+        capacity_ = capacity;
+        return true;
+    }
+};
+
+inline void ring_doorbell(int socket) {
+    char bell = 0;
+    ssize_t ignored = send(socket, &bell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)ignored;
+}
+
+// Sends one frame with `fd` attached to its first byte, or no fd if it is -1
+inline bool send_frame_with_fd(int socket, std::string_view payload, int fd) {
+    std::string frame = encode_frame(payload);
+    iovec iov{ frame.data(), frame.size() };
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (fd != -1) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+    return sendmsg(socket, &message, MSG_NOSIGNAL) == static_cast<ssize_t>(frame.size());
+}
+
+// Blocking receive of one frame and the fd attached to it; `fd` is -1 if
+// none came along
+inline bool receive_frame_with_fd(int socket, std::string& payload, int& fd,
+                                  size_t max_size = MAX_FRAME_SIZE) {
+    fd = -1;
+    unsigned char header[FRAME_HEADER_SIZE];
+    iovec iov{ header, sizeof(header) };
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(socket, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != static_cast<ssize_t>(sizeof(header))) {
+        return false;
+    }
+    for (cmsghdr* c = CMSG_FIRSTHDR(&message); c; c = CMSG_NXTHDR(&message, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&fd, CMSG_DATA(c), sizeof(int));
+        }
+    }
+
+    uint32_t length = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) |
+                      (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+    if (length > max_size) return false;
+    payload.resize(length);
+    return length == 0 || recv(socket, &payload[0], length, MSG_WAITALL) == static_cast<ssize_t>(length);
+}
+
+// Client end of a shared-memory connection
+class ShmClient {
+public:
+    bool attached() const { return socket_ != -1; }
+    int socket() const { return socket_; }
+
+    // Asks for the rings right after connecting, before the username. On
+    // false the connection carries on over the socket, unless the socket
+    // itself failed.
+    bool attach(int socket) {
+        std::string reply;
+        int fd = -1;
+        if (!send_frame(socket, "/shm") || !receive_frame_with_fd(socket, reply, fd)) return false;
+        bool mapped = fd != -1 && reply == "/shm" && segment_.map(fd);
+        if (fd != -1) close(fd);
+        if (!mapped) return false;
+        out_ = segment_.to_server();
+        in_ = segment_.to_client();
+        socket_ = socket;
+        return true;
+    }
+
+    // Writes one frame, sleeping on the doorbell while the ring is full.
+    // Parts of a frame that does not fit at once are announced as they go,
+    // so the server keeps reading. False if the server hung up.
+    bool send(std::string_view payload) {
+        if (payload.size() > MAX_MESSAGE_SIZE) return false;
+        std::string frame = encode_frame(payload);
+        const char* data = frame.data();
+        size_t left = frame.size();
+        while (left > 0) {
+            size_t written = out_.write(data, left);
+            if (written == 0) {
+                uint64_t epoch = doorbell_epoch();
+                if (out_.producer_sleep() && !wait_for_doorbell(epoch)) return false;
+                continue;
+            }
+            data += written;
+            left -= written;
+            if (out_.wake_consumer()) ring_doorbell(socket_);
+        }
+        return true;
+    }
+
+    // Copies out what the server has written so far, without blocking
+    size_t receive(char* out, size_t size) {
+        size_t received = in_.read(out, size);
+        if (received > 0 && in_.wake_producer()) ring_doorbell(socket_);
+        return received;
+    }
+
+    // Call before blocking on the socket; false if data is already waiting
+    bool prepare_wait() { return in_.consumer_sleep(); }
+
+    // For a client that sends on one thread and receives on another. A bell
+    // on the shared socket may be meant for either ring, so only one thread
+    // at a time polls the socket, and every bell it reads wakes both. Take
+    // the epoch before going to sleep in the ring; a bell read by the other
+    // thread since then makes the wait return at once. False on hangup.
+    uint64_t doorbell_epoch() {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+        return epoch_;
+    }
+
+    bool wait_for_doorbell(uint64_t epoch) {
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+        while (epoch_ == epoch && !hung_up_) {
+            if (polling_) {
+                rung_.wait(lock);
+                continue;
+            }
+            polling_ = true;
+            lock.unlock();
+            pollfd doorbell{ socket_, POLLIN, 0 };
+            bool alive = poll(&doorbell, 1, -1) >= 0 || errno == EINTR;
+            alive = alive && drain_doorbells();
+            lock.lock();
+            polling_ = false;
+            hung_up_ = hung_up_ || !alive;
+            ++epoch_;
+            rung_.notify_all();
+        }
+        return !hung_up_;
+    }
+
+    // Reads away doorbells; false once the server has closed the connection
+    bool drain_doorbells() {
+        char bells[64];
+        while (true) {
+            ssize_t received = recv(socket_, bells, sizeof(bells), MSG_DONTWAIT);
+            if (received > 0) continue;
+            return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        }
+    }
+
+private:
+    int socket_ = -1;
+    ShmSegment segment_;
+    ShmRing out_;
+    ShmRing in_;
+    std::mutex wait_mutex_;  // guards the fields below
+    std::condition_variable rung_;
+    uint64_t epoch_ = 0;     // polls of the socket that have returned
+    bool polling_ = false;
+    bool hung_up_ = false;
+};
+
+#endif
@@ -0,0 +1,137 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Hierarchical timing wheel: LEVELS wheels of SLOTS slots each, where a slot
+// of level n spans SLOTS^n ticks. A timer goes into the coarsest slot that
+// still tells it apart from now and is moved one level down each time the
+// wheel below completes a turn, so scheduling and cancelling are O(1) and
+// every timer is touched at most LEVELS times before it fires, however many
+// of them there are.
+class TimerWheel {
+public:
+    // Embedded in whatever it times, so scheduling never allocates. It must
+    // be cancelled before its owner goes away.
+    struct Timer {
+        Timer* prev = nullptr;
+        Timer* next = nullptr;
+        uint64_t expires = 0;  // in ticks
+        uint64_t data = 0;     // handed back on expiry
+
+        bool scheduled() const { return next != nullptr; }
+    };
+
+    TimerWheel(uint64_t tick_ms, uint64_t now_ms) : tick_ms_(tick_ms), current_(now_ms / tick_ms) {
+        for (auto& level : slots_) {
+            for (Timer& head : level) {
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    size_t size() const { return size_; }
+
+    // (Re)schedules `timer` to fire on the first tick at or after `deadline_ms`
+    void schedule(Timer& timer, uint64_t deadline_ms) {
+        cancel(timer);
+        timer.expires = (deadline_ms + tick_ms_ - 1) / tick_ms_;
+        insert(timer);
+        ++size_;
+    }
+
+    void cancel(Timer& timer) {
+        if (!timer.scheduled()) return;
+        unlink(timer);
+        --size_;
+    }
+
+    // Runs every tick up to `now_ms` and calls expired(timer) for each timer
+    // that came due. The callback may schedule and cancel timers, including
+    // the one it was given.
+    template <typename Expired>
+    void advance(uint64_t now_ms, Expired&& expired) {
+        uint64_t target = now_ms / tick_ms_;
+        while (current_ <= target) {
+            // Each time a wheel completes a turn, the next slot of the wheel
+            // above is spread out over the levels below it
+            for (int level = 1; level < LEVELS; ++level) {
+                if ((current_ & ((uint64_t(1) << (level * LEVEL_BITS)) - 1)) != 0) break;
+                cascade(slots_[level][(current_ >> (level * LEVEL_BITS)) & SLOT_MASK]);
+            }
+
+            // Detach the slot first so timers rescheduled from the callback
+            // land in a later tick, not back in the list being walked
+            Timer due;
+            take(slots_[0][current_ & SLOT_MASK], due);
+            ++current_;
+            while (due.next != &due) {
+                Timer& timer = *due.next;
+                unlink(timer);
+                --size_;
+                expired(timer);
+            }
+        }
+    }
+
+private:
+    static const int LEVEL_BITS = 6;
+    static const int LEVELS = 4;
+    static const uint64_t SLOTS = uint64_t(1) << LEVEL_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+    // Furthest ahead a timer can be set; later deadlines are clamped to it
+    static const uint64_t MAX_DELTA = (uint64_t(1) << (LEVELS * LEVEL_BITS)) - 1;
+
+    uint64_t tick_ms_;
+    uint64_t current_;  // next tick to run
+    size_t size_ = 0;
+    Timer slots_[LEVELS][SLOTS];  // list heads
+
+    void insert(Timer& timer) {
+        if (timer.expires < current_) timer.expires = current_;
+        uint64_t delta = timer.expires - current_;
+        if (delta > MAX_DELTA) {
+            timer.expires = current_ + MAX_DELTA;
+            delta = MAX_DELTA;
+        }
+        int level = 0;
+        while (level + 1 < LEVELS && delta >= (uint64_t(1) << ((level + 1) * LEVEL_BITS))) {
+            ++level;
+        }
+        Timer& head = slots_[level][(timer.expires >> (level * LEVEL_BITS)) & SLOT_MASK];
+        timer.prev = head.prev;
+        timer.next = &head;
+        head.prev->next = &timer;
+        head.prev = &timer;
+    }
+
+    static void unlink(Timer& timer) {
+        timer.prev->next = timer.next;
+        timer.next->prev = timer.prev;
+        timer.prev = timer.next = nullptr;
+    }
+
+    // Moves every timer of the list at `from` to the empty list `to`
+    static void take(Timer& from, Timer& to) {
+        to.prev = to.next = &to;
+        if (from.next == &from) return;
+        to.next = from.next;
+        to.prev = from.prev;
+        to.next->prev = &to;
+        to.prev->next = &to;
+        from.prev = from.next = &from;
+    }
+
+    void cascade(Timer& head) {
+        Timer moving;
+        take(head, moving);
+        while (moving.next != &moving) {
+            Timer& timer = *moving.next;
+            unlink(timer);
+            insert(timer);
+        }
+    }
+};
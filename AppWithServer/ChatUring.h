@@ -0,0 +1,267 @@
+﻿#pragma once
+
+// Minimal io_uring wrapper for ChatServer, talking to the kernel directly so
+// the server has no dependency beyond the kernel headers. Only built where
+// <linux/io_uring.h> exists; at runtime init() fails cleanly on kernels or
+// sandboxes without io_uring and the server stays on epoll.
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define CHAT_HAVE_IO_URING 1
+
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+class IoUring {
+public:
+    IoUring() = default;
+
+    // user_data of requests the wrapper makes for itself. Returning receive
+    // buffer `id` uses RECYCLE + id, so a failure says which buffer it was.
+    static const uint64_t INTERNAL = UINT64_MAX;
+    static const uint64_t RECYCLE = INTERNAL - 0x10000;
+
+    // A buffer whose return the kernel refuses this many times in a row is
+    // given up on, rather than retried on every pass
+    static const unsigned MAX_RECYCLE_ATTEMPTS = 3;
+
+    ~IoUring() {
+        std::free(buffers_);
+        if (sqes_ != MAP_FAILED && sqes_) munmap(sqes_, sqes_size_);
+        if (cq_ring_ != MAP_FAILED && cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != MAP_FAILED && sq_ring_) munmap(sq_ring_, sq_ring_size_);
+        if (ring_fd_ != -1) close(ring_fd_);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Sets up a ring with `entries` submission slots and room for several
+    // times as many completions, since multishot requests post many each
+    bool init(unsigned entries) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = entries * 8;
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_fd_ < 0) {
+            // Older kernels reject COOP_TASKRUN; try once more without it
+            params = io_uring_params{};
+            params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+            params.cq_entries = entries * 8;
+            ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        }
+        if (ring_fd_ < 0) {
+            ring_fd_ = -1;
+            return false;
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) return false;
+        cq_ring_ = single_mmap ? sq_ring_
+                               : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) return false;
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) return false;
+
+        char* sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<std::atomic<unsigned>*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<std::atomic<unsigned>*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+
+        char* cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<std::atomic<unsigned>*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<std::atomic<unsigned>*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        sqe_tail_ = sq_tail_->load(std::memory_order_relaxed);
+        return true;
+    }
+
+    // Hands the kernel `count` receive buffers of `size` bytes to pick from
+    // for multishot receives. These are classic provided buffers rather than a
+    // buffer ring: they work with multishot receive on every kernel that has
+    // it, and returning one is an SQE that rides along with the next submit.
+    bool provide_buffers(uint16_t group, unsigned count, unsigned size) {
+        buffers_ = static_cast<char*>(std::malloc(static_cast<size_t>(count) * size));
+        if (!buffers_) return false;
+        recycle_failures_.assign(count, 0);
+        buffer_group_ = group;
+        buffer_size_ = size;
+
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int>(count);
+        sqe->addr = reinterpret_cast<uint64_t>(buffers_);
+        sqe->len = size;
+        sqe->buf_group = group;
+        sqe->off = 0;
+        sqe->user_data = INTERNAL;
+        if (submit_and_wait(1) < 0) return false;
+
+        int result = -1;
+        drain_completions([&](const io_uring_cqe& cqe) { result = cqe.res; });
+        buffers_ready_ = result >= 0;
+        return buffers_ready_;
+    }
+
+    uint16_t buffer_group() const { return buffer_group_; }
+    const char* buffer(uint16_t id) const { return buffers_ + static_cast<size_t>(id) * buffer_size_; }
+
+    // Hands a consumed receive buffer back to the kernel with the next submit
+    void recycle_buffer(uint16_t id) {
+        recycle_failures_[id] = 0;
+        provide_buffer(id);
+    }
+
+    // Receive buffers the kernel would not take back, each after
+    // MAX_RECYCLE_ATTEMPTS tries; multishot receives have that many fewer
+    uint64_t buffers_lost() const { return buffers_lost_; }
+
+    // Set once a full submission queue could not be submitted. The request
+    // that needed the room is dropped, and submit_and_wait() returns the
+    // error from then on; the ring is of no further use.
+    bool failed() const { return error_ < 0; }
+
+    // Next free submission entry, cleared. Submits what is queued when the
+    // ring is full, which only happens under very large batches.
+    io_uring_sqe* get_sqe() {
+        while (error_ == 0 && sqe_tail_ - sq_head_->load(std::memory_order_acquire) >= sq_entries_) {
+            int result = submit_and_wait(0);
+            if (result == -EINTR || result == -EAGAIN) continue;
+            if (result <= 0) error_ = result < 0 ? result : -EBUSY;
+        }
+        if (error_ < 0) {
+            std::memset(&discarded_, 0, sizeof(discarded_));
+            return &discarded_;
+        }
+        unsigned index = sqe_tail_ & sq_mask_;
+        io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        ++sqe_tail_;
+        return sqe;
+    }
+
+    // Submits everything queued since the last call and, with wait_nr > 0,
+    // blocks until that many completions are ready; one syscall either way
+    int submit_and_wait(unsigned wait_nr) {
+        if (error_ < 0) return error_;
+        unsigned to_submit = sqe_tail_ - sq_tail_->load(std::memory_order_relaxed);
+        sq_tail_->store(sqe_tail_, std::memory_order_release);
+        if (to_submit == 0 && wait_nr == 0) return 0;
+        if (wait_nr > 0 && cq_head_->load(std::memory_order_relaxed) != cq_tail_->load(std::memory_order_acquire)) {
+            wait_nr = 0;  // completions are already waiting
+            if (to_submit == 0) return 0;
+        }
+        ++enters_;
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int result = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr, flags, nullptr, 0));
+        return result < 0 ? -errno : result;
+    }
+
+    // Calls handler(cqe) for every ready completion and marks them consumed.
+    // Completions of the wrapper's own requests are passed on only while
+    // nothing else is in flight, during setup; after that, a buffer the
+    // kernel refused is offered again with the next submit.
+    template <typename Handler>
+    unsigned drain_completions(Handler&& handler) {
+        unsigned head = cq_head_->load(std::memory_order_relaxed);
+        unsigned tail = cq_tail_->load(std::memory_order_acquire);
+        unsigned seen = 0;
+        while (head != tail) {
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            ++head;
+            ++seen;
+            // Release the slot before handling so the handler may queue more work
+            cq_head_->store(head, std::memory_order_release);
+            if (cqe.user_data >= RECYCLE && buffers_ready_) {
+                if (cqe.user_data != INTERNAL && cqe.res < 0) {
+                    retry_recycle(static_cast<uint16_t>(cqe.user_data - RECYCLE));
+                }
+                continue;
+            }
+            handler(cqe);
+        }
+        return seen;
+    }
+
+    // Number of io_uring_enter calls made so far
+    uint64_t enters() const { return enters_; }
+
+private:
+    void provide_buffer(uint16_t id) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1;
+        sqe->addr = reinterpret_cast<uint64_t>(buffer(id));
+        sqe->len = buffer_size_;
+        sqe->buf_group = buffer_group_;
+        sqe->off = id;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = RECYCLE + id;
+    }
+
+    void retry_recycle(uint16_t id) {
+        if (++recycle_failures_[id] < MAX_RECYCLE_ATTEMPTS) {
+            provide_buffer(id);
+        } else {
+            ++buffers_lost_;
+        }
+    }
+
+    int ring_fd_ = -1;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    void* sqes_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    size_t sqes_size_ = 0;
+
+    std::atomic<unsigned>* sq_head_ = nullptr;
+    std::atomic<unsigned>* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_entries_ = 0;
+    unsigned sqe_tail_ = 0;  // entries handed out, published to sq_tail_ on submit
+
+    std::atomic<unsigned>* cq_head_ = nullptr;
+    std::atomic<unsigned>* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+
+    char* buffers_ = nullptr;
+    uint16_t buffer_group_ = 0;
+    unsigned buffer_size_ = 0;
+    bool buffers_ready_ = false;
+    std::vector<uint8_t> recycle_failures_;  // by buffer id, since it was last returned
+    uint64_t buffers_lost_ = 0;
+
+    io_uring_sqe discarded_{};  // handed out once the ring has failed
+    int error_ = 0;
+    uint64_t enters_ = 0;
+};
+
+#endif
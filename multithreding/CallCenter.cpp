@@ -6,110 +6,1711 @@
 #include <condition_variable>
 #include <chrono>
 #include <vector>
+#include <deque>
+#include <unordered_set>
+#include <algorithm>
 #include <memory>  // for std::unique_ptr
 #include <random>
 #include <atomic>
+#include <functional>
+#include <limits>
+#include <future>
+#include <cstdint>
+#include <cmath>
+#include <coroutine>
+#include <array>
+#include <string>
+#include <bit>
+#include <initializer_list>
+#include <fstream>
+#include <sstream>
+#include <charconv>
+#include <stdexcept>
+#include <filesystem>
 #include <gtest/gtest.h>
 #include "spdlog/spdlog.h"
+#include "spdlog/sinks/base_sink.h"
 #include "spdlog/sinks/basic_file_sink.h"
 #include "spdlog/sinks/stdout_color_sinks.h"  // Console sink
 
+// What AsyncLog::info() does when the queue is full
+enum class LogOverflow {
+    Block,  // sleep until the flush thread makes room
+    Drop    // discard the line and count it
+};
+
+// Keeps logging off the caller's thread: info() formats straight into a slot
+// of a bounded lock-free queue and returns, and a background thread writes
+// the queued lines to the spdlog logger, which flushes as its flush_on level
+// says, and flushes once more after each batch. Each line keeps the time it
+// was logged at, and the destructor writes out whatever is still queued.
+class AsyncLog {
+public:
+    static const size_t MAX_LINE = 240;  // longer lines are cut short
+
+    // `capacity` is rounded up to a power of two
+    explicit AsyncLog(std::shared_ptr<spdlog::logger> sink, size_t capacity = 4096,
+                      LogOverflow overflow = LogOverflow::Block)
+        : sink_(std::move(sink)), overflow_(overflow) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots_ = std::vector<Slot>(size);
+        mask_ = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        flusher_ = std::thread(&AsyncLog::run, this);
+    }
+
+    // Writes out everything still queued
+    ~AsyncLog() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopping_ = true;
+            sleeping_.store(0, std::memory_order_relaxed);
+        }
+        wake_.notify_one();
+        flusher_.join();
+    }
+
+    AsyncLog(const AsyncLog&) = delete;
+    AsyncLog& operator=(const AsyncLog&) = delete;
+
+    void setEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+    void setOverflow(LogOverflow overflow) { overflow_.store(overflow, std::memory_order_relaxed); }
+    uint64_t dropped() const { return droppedTotal_.load(std::memory_order_relaxed); }
+
+    template <typename... Args>
+    void info(fmt::format_string<Args...> format, Args&&... args) {
+        if (!enabled_.load(std::memory_order_relaxed) || !sink_) return;
+        uint64_t position;
+        Slot* slot = claimSlot(position);
+        if (!slot) return;
+        auto result = fmt::format_to_n(slot->text, MAX_LINE, format, std::forward<Args>(args)...);
+        slot->size = std::min(result.size, MAX_LINE);
+        slot->time = spdlog::log_clock::now();
+        slot->sequence.store(position + 1, std::memory_order_release);
+        // Same handshake as a producer ringing a sleeping consumer's doorbell
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed) != 0 && sleeping_.exchange(0) != 0) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            wake_.notify_one();
+        }
+    }
+
+    // Returns once every line logged so far has been written and flushed
+    void flush() {
+        uint64_t target = enqueuePos_.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(mtx_);
+        sleeping_.store(0, std::memory_order_relaxed);
+        wake_.notify_one();
+        flushed_.wait(lock, [this, target] { return flushedPos_ >= target; });
+    }
+
+private:
+    // A slot is free for position p when its sequence is p and holds the line
+    // for position p once its sequence is p + 1
+    struct Slot {
+        std::atomic<uint64_t> sequence{ 0 };
+        size_t size = 0;
+        spdlog::log_clock::time_point time;
+        char text[MAX_LINE];
+    };
+
+    std::shared_ptr<spdlog::logger> sink_;
+    std::vector<Slot> slots_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<uint64_t> enqueuePos_{ 0 };
+    alignas(64) uint64_t dequeuePos_ = 0;  // flush thread only
+    std::atomic<bool> enabled_{ true };
+    std::atomic<LogOverflow> overflow_;
+    std::atomic<uint64_t> dropped_{ 0 };       // not yet reported
+    std::atomic<uint64_t> droppedTotal_{ 0 };
+    std::atomic<uint32_t> sleeping_{ 0 };
+    std::atomic<uint32_t> blocked_{ 0 };  // callers waiting for room
+    std::mutex mtx_;  // guards the sleeps, flushedPos_ and stopping_
+    std::condition_variable wake_;
+    std::condition_variable room_;
+    std::condition_variable flushed_;
+    uint64_t flushedPos_ = 0;
+    bool stopping_ = false;
+    std::thread flusher_;
+
+    // Returns nullptr when the queue is full and lines are being dropped
+    Slot* claimSlot(uint64_t& position) {
+        position = enqueuePos_.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots_[position & mask_];
+            int64_t lag = static_cast<int64_t>(slot.sequence.load(std::memory_order_acquire) - position);
+            if (lag == 0) {
+                if (enqueuePos_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    return &slot;
+                }
+            }
+            else if (lag < 0) {
+                if (overflow_.load(std::memory_order_relaxed) == LogOverflow::Drop) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    droppedTotal_.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+                waitForRoom(slot, position);
+                position = enqueuePos_.load(std::memory_order_relaxed);
+            }
+            else {
+                position = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Sleeps until the flush thread has written out the line in `slot`
+    void waitForRoom(Slot& slot, uint64_t position) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        blocked_.fetch_add(1, std::memory_order_relaxed);
+        // Pairs with the fence in run(): either it sees this waiter, or this
+        // sees the slot it freed
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        room_.wait(lock, [&] {
+            return static_cast<int64_t>(slot.sequence.load(std::memory_order_acquire) - position) >= 0;
+        });
+        blocked_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    Slot* front() {
+        Slot& slot = slots_[dequeuePos_ & mask_];
+        return slot.sequence.load(std::memory_order_acquire) == dequeuePos_ + 1 ? &slot : nullptr;
+    }
+
+    void run() {
+        while (true) {
+            bool wrote = false;
+            while (Slot* slot = front()) {
+                sink_->log(slot->time, spdlog::source_loc{}, spdlog::level::info,
+                           spdlog::string_view_t(slot->text, slot->size));
+                slot->sequence.store(dequeuePos_ + mask_ + 1, std::memory_order_release);
+                ++dequeuePos_;
+                wrote = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (blocked_.load(std::memory_order_relaxed) != 0) {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    room_.notify_all();
+                }
+            }
+            if (uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+                sink_->warn("{} log lines dropped while the log queue was full", dropped);
+                wrote = true;
+            }
+            if (wrote) {
+                sink_->flush();
+            }
+
+            std::unique_lock<std::mutex> lock(mtx_);
+            flushedPos_ = dequeuePos_;
+            flushed_.notify_all();
+            if (stopping_ && !front()) {
+                return;
+            }
+            sleeping_.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (front()) {
+                sleeping_.store(0, std::memory_order_relaxed);
+                continue;
+            }
+            wake_.wait(lock, [this] { return sleeping_.load(std::memory_order_relaxed) == 0 || stopping_; });
+        }
+    }
+};
+
 // Class for logging setup
 class Logger {
 public:
+    // The sinks; writes through here are synchronous
     static std::shared_ptr<spdlog::logger> getInstance() {
-        static std::shared_ptr<spdlog::logger> logger = nullptr;
-        if (!logger) {
+        static std::shared_ptr<spdlog::logger> logger = [] {
+            std::shared_ptr<spdlog::logger> created;
             try {
                 auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
                 auto file_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("call_center_log.txt", true);
-                logger = std::make_shared<spdlog::logger>("call_center_logger", spdlog::sinks_init_list{ console_sink, file_sink });
-                logger->set_level(spdlog::level::info);
-                logger->flush_on(spdlog::level::info);
+                created = std::make_shared<spdlog::logger>("call_center_logger", spdlog::sinks_init_list{ console_sink, file_sink });
+                created->set_level(spdlog::level::info);
+                created->flush_on(spdlog::level::info);
+            }
+            catch (const spdlog::spdlog_ex& ex) {
+                std::cerr << "Log initialization failed: " << ex.what() << std::endl;
+            }
+            return created;
+        }();
+        return logger;
+    }
+
+    static AsyncLog& async() {
+        static AsyncLog instance(getInstance());
+        return instance;
+    }
+};
+
+// Logging function; the arguments are formatted on the caller's thread, into
+// the queue, with no intermediate strings
+template <typename... Args>
+void log(fmt::format_string<Args...> format, Args&&... args) {
+    Logger::async().info(format, std::forward<Args>(args)...);
+}
+
+// Callbacks waiting for their time, earliest first; callbacks due at the
+// same time come out in the order they went in. A cancelled callback never
+// runs; it is dropped once it reaches the front of the heap.
+class EventCalendar {
+public:
+    bool empty() const { return pending_.empty(); }
+    size_t size() const { return pending_.size(); }
+    int64_t nextDue() const { return events_.front().dueMs; }
+
+    // Returns an id for cancel(); ids start at 1
+    uint64_t push(int64_t dueMs, std::function<void()> callback) {
+        uint64_t id = nextSequence_++;
+        events_.push_back({ dueMs, id, std::move(callback) });
+        std::push_heap(events_.begin(), events_.end(), Later());
+        pending_.insert(id);
+        return id;
+    }
+
+    std::function<void()> pop() {
+        std::pop_heap(events_.begin(), events_.end(), Later());
+        std::function<void()> callback = std::move(events_.back().callback);
+        pending_.erase(events_.back().sequence);
+        events_.pop_back();
+        dropCancelled();
+        return callback;
+    }
+
+    // False if the callback was already popped or cancelled
+    bool cancel(uint64_t id) {
+        if (pending_.erase(id) == 0) {
+            return false;
+        }
+        dropCancelled();
+        return true;
+    }
+
+private:
+    struct Event {
+        int64_t dueMs;
+        uint64_t sequence;
+        std::function<void()> callback;
+    };
+
+    struct Later {
+        bool operator()(const Event& a, const Event& b) const {
+            return a.dueMs != b.dueMs ? a.dueMs > b.dueMs : a.sequence > b.sequence;
+        }
+    };
+
+    std::vector<Event> events_;  // binary heap, cancelled events included
+    std::unordered_set<uint64_t> pending_;  // ids not yet popped or cancelled
+    uint64_t nextSequence_ = 1;
+
+    // Keeps a live event at the front, so nextDue() is never a cancelled one's
+    void dropCancelled() {
+        while (!events_.empty() && !pending_.count(events_.front().sequence)) {
+            std::pop_heap(events_.begin(), events_.end(), Later());
+            events_.pop_back();
+        }
+    }
+};
+
+// Time source and timers for the event-driven call center, in milliseconds
+// from an arbitrary start. Callbacks run one at a time on the clock's own
+// thread, so whatever they touch needs no locking.
+class Clock {
+public:
+    virtual ~Clock() = default;
+
+    virtual int64_t nowMs() const = 0;
+
+    // Runs callback once delayMs have passed; returns an id for cancel()
+    virtual uint64_t schedule(int64_t delayMs, std::function<void()> callback) = 0;
+
+    // Keeps a scheduled callback from running. False if it has already
+    // started, or run, or been cancelled.
+    virtual bool cancel(uint64_t timer) = 0;
+};
+
+// Real time, for production: a timer thread sleeps until the next callback
+// is due. Callbacks still pending when the clock is destroyed never run.
+class WallClock : public Clock {
+public:
+    WallClock() : start_(std::chrono::steady_clock::now()), timerThread_(&WallClock::run, this) {}
+
+    ~WallClock() override {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        timerThread_.join();
+    }
+
+    int64_t nowMs() const override {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+    // A delay counts from the current time rounded up, so the callback never
+    // runs before delayMs have passed; no delay means as soon as possible
+    uint64_t schedule(int64_t delayMs, std::function<void()> callback) override {
+        int64_t dueMs = delayMs > 0
+            ? std::chrono::ceil<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_).count() + delayMs
+            : nowMs();
+        uint64_t timer;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            timer = calendar_.push(dueMs, std::move(callback));
+        }
+        wake_.notify_one();
+        return timer;
+    }
+
+    bool cancel(uint64_t timer) override {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return calendar_.cancel(timer);
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+    std::mutex mtx_;
+    std::condition_variable wake_;
+    EventCalendar calendar_;
+    bool stopping_ = false;
+    std::thread timerThread_;  // last, so it starts after everything it uses
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        while (!stopping_) {
+            if (calendar_.empty()) {
+                wake_.wait(lock);
+            }
+            else if (calendar_.nextDue() > nowMs()) {
+                wake_.wait_until(lock, start_ + std::chrono::milliseconds(calendar_.nextDue()));
+            }
+            else {
+                std::function<void()> callback = calendar_.pop();
+                lock.unlock();
+                callback();
+                lock.lock();
+            }
+        }
+    }
+};
+
+// Virtual time for simulation: run() jumps from one callback to the next,
+// so simulated hours take as long as the callbacks themselves. Nothing runs
+// until run() is called, on the caller's thread.
+class SimulatedClock : public Clock {
+public:
+    int64_t nowMs() const override { return nowMs_; }
+
+    uint64_t schedule(int64_t delayMs, std::function<void()> callback) override {
+        return calendar_.push(nowMs_ + std::max<int64_t>(delayMs, 0), std::move(callback));
+    }
+
+    bool cancel(uint64_t timer) override { return calendar_.cancel(timer); }
+
+    // Runs callbacks in time order until none is due at or before untilMs;
+    // returns how many ran
+    uint64_t run(int64_t untilMs = std::numeric_limits<int64_t>::max()) {
+        uint64_t count = 0;
+        while (!calendar_.empty() && calendar_.nextDue() <= untilMs) {
+            nowMs_ = calendar_.nextDue();
+            calendar_.pop()();
+            ++count;
+        }
+        return count;
+    }
+
+private:
+    int64_t nowMs_ = 0;
+    EventCalendar calendar_;
+};
+
+// Operator class
+class Operator {
+public:
+    Operator(int id, Clock& clock) : id_(id), clock_(clock), is_busy_(false) {}
+
+    Operator(const Operator&) = delete;
+    Operator& operator=(const Operator&) = delete;
+
+    int id() const { return id_; }
+    bool isBusy() const { return is_busy_; }
+
+    // Only the CallCenter marks an operator busy or free, as it claims and
+    // releases it, so an operator handed from one client to the next is
+    // never seen free
+    void setBusy(bool busy) { is_busy_ = busy; }
+
+    // Takes the call; onFinished runs on the clock once serveDuration
+    // milliseconds have passed
+    void serveClient(int clientId, int64_t serveDuration, std::function<void()> onFinished) {
+        log("Operator {} is serving client {}", id_, clientId);
+        clock_.schedule(serveDuration, [this, clientId, onFinished = std::move(onFinished)]() {
+            log("Operator {} finished serving client {}", id_, clientId);
+            onFinished();
+        });
+    }
+
+private:
+    int id_;
+    Clock& clock_;
+    std::atomic<bool> is_busy_;
+};
+
+// Histogram of durations in microseconds with 16 buckets per power of two,
+// so any percentile it reports is within 1/16 of the true value
+class Histogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BITS = 40;  // about 12 days
+    static const int BUCKETS = SUB_BUCKETS * (MAX_BITS - SUB_BITS + 1);
+
+    static int bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<int>(value);
+        }
+        int top = std::bit_width(value) - 1;
+        if (top >= MAX_BITS) {
+            return BUCKETS - 1;
+        }
+        int shift = top - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Smallest value that falls into `bucket`
+    static uint64_t lowestIn(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return static_cast<uint64_t>(bucket);
+        }
+        int shift = bucket / SUB_BUCKETS - 1;
+        return static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    }
+
+    void record(uint64_t value) { add(bucketOf(value), 1, value, value, value); }
+
+    // Adds `count` values that fell into `bucket`; min and max are kept exact
+    void add(int bucket, uint64_t count, uint64_t sum, uint64_t min, uint64_t max) {
+        if (count == 0) return;
+        counts_[bucket] += count;
+        count_ += count;
+        sum_ += sum;
+        min_ = std::min(min_, min);
+        max_ = std::max(max_, max);
+    }
+
+    void merge(const Histogram& other) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t sum() const { return sum_; }
+    uint64_t min() const { return count_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0.0; }
+
+    // Value below which `fraction` of the recorded values lie
+    uint64_t percentile(double fraction) const {
+        if (count_ == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * count_));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= std::max<uint64_t>(rank, 1)) {
+                uint64_t upper = i + 1 < BUCKETS ? lowestIn(i + 1) - 1 : max_;
+                return std::clamp(upper, min(), max_);
+            }
+        }
+        return max_;
+    }
+
+    // How many recorded values are at most `value`, counting a bucket that
+    // holds `value` as all below it
+    uint64_t countAtMost(uint64_t value) const {
+        uint64_t below = 0;
+        for (int i = 0; i <= bucketOf(value); ++i) {
+            below += counts_[i];
+        }
+        return below;
+    }
+
+private:
+    std::array<uint64_t, BUCKETS> counts_{};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = std::numeric_limits<uint64_t>::max();
+    uint64_t max_ = 0;
+};
+
+// Erlang C: the probability that a call has to wait, with `agents` agents
+// and `load` Erlangs offered, in an M/M/c queue where nobody hangs up
+double erlangC(int agents, double load) {
+    if (load >= agents) {
+        return 1.0;
+    }
+    double blocking = 1.0;  // Erlang B, built up one agent at a time
+    for (int k = 1; k <= agents; ++k) {
+        blocking = load * blocking / (k + load * blocking);
+    }
+    return agents * blocking / (agents - load * (1.0 - blocking));
+}
+
+// Erlang C's fraction of calls answered within `targetSeconds`
+double erlangServiceLevel(int agents, double load, double meanServiceSeconds, double targetSeconds) {
+    if (load >= agents) {
+        return 0.0;
+    }
+    return 1.0 - erlangC(agents, load) * std::exp(-(agents - load) * targetSeconds / meanServiceSeconds);
+}
+
+// Everything CallStats has recorded, merged from all threads
+struct CallStatsSnapshot {
+    Histogram wait;     // served clients, until an operator picked up; microseconds
+    Histogram abandon;  // clients who hung up, until they did
+    Histogram service;  // call lengths
+    double elapsedSeconds = 0;
+
+    uint64_t served() const { return wait.count(); }
+    uint64_t abandoned() const { return abandon.count(); }
+    uint64_t calls() const { return served() + abandoned(); }
+
+    double abandonRate() const { return calls() ? static_cast<double>(abandoned()) / calls() : 0.0; }
+
+    // Share of the operators' time spent on calls
+    double utilization(int operatorCount) const {
+        return elapsedSeconds > 0 ? service.sum() / 1e6 / (operatorCount * elapsedSeconds) : 0.0;
+    }
+
+    // Share of all calls, abandoned ones included, answered within targetMs
+    double serviceLevel(int targetMs) const {
+        return calls() ? static_cast<double>(wait.countAtMost(uint64_t(targetMs) * 1000)) / calls() : 0.0;
+    }
+
+    // What was observed next to what Erlang C predicts for the same arrival
+    // rate, call length and operator count. Erlang C assumes nobody hangs
+    // up, so with many abandoned calls the observed waits come out shorter.
+    std::string report(int operatorCount, int targetMs) const {
+        double arrivalRate = elapsedSeconds > 0 ? calls() / elapsedSeconds : 0.0;
+        double meanService = service.mean() / 1e6;
+        double load = arrivalRate * meanService;
+        double waitProbability = erlangC(operatorCount, load);
+        double predictedAsa = load < operatorCount ? waitProbability * meanService / (operatorCount - load) : INFINITY;
+        return fmt::format(
+            "calls {} served {} abandoned {} ({:.1f}%) over {:.1f} s\n"
+            "wait ms p50 {:.1f} p90 {:.1f} p99 {:.1f} max {:.1f}\n"
+            "service ms p50 {:.1f} p90 {:.1f} max {:.1f}; utilization {:.1f}% of {} operators\n"
+            "offered load {:.2f} Erlangs: answered within {} ms {:.1f}% observed, {:.1f}% Erlang C; "
+            "mean wait {:.1f} ms observed, {:.1f} ms Erlang C (P(wait) {:.2f})",
+            calls(), served(), abandoned(), 100 * abandonRate(), elapsedSeconds,
+            wait.percentile(0.5) / 1e3, wait.percentile(0.9) / 1e3, wait.percentile(0.99) / 1e3, wait.max() / 1e3,
+            service.percentile(0.5) / 1e3, service.percentile(0.9) / 1e3, service.max() / 1e3,
+            100 * utilization(operatorCount), operatorCount,
+            load, targetMs, 100 * serviceLevel(targetMs),
+            100 * erlangServiceLevel(operatorCount, load, meanService, targetMs / 1e3),
+            wait.mean() / 1e3, predictedAsa * 1e3, waitProbability);
+    }
+};
+
+// Records what happens to every call. Recording goes to one of a fixed set
+// of shards, picked by the thread's id, with relaxed atomic adds, so it
+// takes no lock and threads seldom share a cache line; snapshot() adds the
+// shards up. Memory stays the same however many threads record. Elapsed
+// time is the clock's, so a simulated day reports as a day.
+class CallStats {
+public:
+    explicit CallStats(const Clock& clock)
+        : clock_(clock), startMs_(clock.nowMs()),
+          shardCount_(std::max(1u, std::thread::hardware_concurrency())),
+          shards_(std::make_unique<Recorder[]>(shardCount_)) {}
+
+    CallStats(const CallStats&) = delete;
+    CallStats& operator=(const CallStats&) = delete;
+
+    void recordServed(std::chrono::microseconds wait, std::chrono::microseconds service) {
+        Recorder& recorder = local();
+        recorder.wait.record(wait.count());
+        recorder.service.record(service.count());
+    }
+
+    void recordAbandoned(std::chrono::microseconds wait) { local().abandon.record(wait.count()); }
+
+    CallStatsSnapshot snapshot() const {
+        CallStatsSnapshot merged;
+        for (size_t i = 0; i < shardCount_; ++i) {
+            shards_[i].wait.addTo(merged.wait);
+            shards_[i].abandon.addTo(merged.abandon);
+            shards_[i].service.addTo(merged.service);
+        }
+        merged.elapsedSeconds = (clock_.nowMs() - startMs_) / 1e3;
+        return merged;
+    }
+
+private:
+    // Written by any thread and read by snapshot() at any time
+    class AtomicHistogram {
+    public:
+        void record(int64_t value) {
+            uint64_t v = value > 0 ? static_cast<uint64_t>(value) : 0;
+            counts_[Histogram::bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(v, std::memory_order_relaxed);
+            uint64_t seen = min_.load(std::memory_order_relaxed);
+            while (v < seen && !min_.compare_exchange_weak(seen, v, std::memory_order_relaxed)) {}
+            seen = max_.load(std::memory_order_relaxed);
+            while (v > seen && !max_.compare_exchange_weak(seen, v, std::memory_order_relaxed)) {}
+        }
+
+        // A snapshot taken while calls are recorded may be a call or two
+        // behind in places; it is never torn within one counter
+        void addTo(Histogram& into) const {
+            Histogram mine;
+            uint64_t min = min_.load(std::memory_order_relaxed);
+            uint64_t max = max_.load(std::memory_order_relaxed);
+            uint64_t sum = sum_.load(std::memory_order_relaxed);
+            bool first = true;
+            for (int i = 0; i < Histogram::BUCKETS; ++i) {
+                uint64_t count = counts_[i].load(std::memory_order_relaxed);
+                if (count == 0) continue;
+                mine.add(i, count, first ? sum : 0, min, max);
+                first = false;
+            }
+            into.merge(mine);
+        }
+
+    private:
+        std::array<std::atomic<uint64_t>, Histogram::BUCKETS> counts_{};
+        std::atomic<uint64_t> sum_{ 0 };
+        std::atomic<uint64_t> min_{ std::numeric_limits<uint64_t>::max() };
+        std::atomic<uint64_t> max_{ 0 };
+    };
+
+    struct alignas(64) Recorder {
+        AtomicHistogram wait;
+        AtomicHistogram abandon;
+        AtomicHistogram service;
+    };
+
+    const Clock& clock_;
+    int64_t startMs_;
+    size_t shardCount_;
+    std::unique_ptr<Recorder[]> shards_;
+
+    Recorder& local() {
+        return shards_[std::hash<std::thread::id>{}(std::this_thread::get_id()) % shardCount_];
+    }
+};
+
+// Small, fast generator (SplitMix64) for the draws of a single call
+class CallRandom {
+public:
+    using result_type = uint64_t;
+
+    explicit CallRandom(uint64_t seed) : state_(seed) {}
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    result_type operator()() {
+        uint64_t z = (state_ += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+private:
+    uint64_t state_;
+};
+
+// Random number streams derived from one seed, one per client, so a seed
+// gives each client the same draws whichever thread serves it and in
+// whatever order the calls come
+class RandomStreams {
+public:
+    explicit RandomStreams(uint64_t seed) : seed_(seed) {}
+
+    CallRandom forClient(int clientId) const {
+        CallRandom mixed(seed_ ^ (static_cast<uint64_t>(static_cast<uint32_t>(clientId)) << 32));
+        return CallRandom(mixed());
+    }
+
+private:
+    uint64_t seed_;
+};
+
+// How long calls last. Samples must be safe to draw from several threads at
+// once, each with its own generator.
+class ServiceTime {
+public:
+    virtual ~ServiceTime() = default;
+    virtual int64_t sampleMs(CallRandom& rng) const = 0;
+};
+
+class UniformServiceTime : public ServiceTime {
+public:
+    UniformServiceTime(int64_t minMs, int64_t maxMs) : minMs_(minMs), maxMs_(maxMs) {}
+
+    int64_t sampleMs(CallRandom& rng) const override {
+        return std::uniform_int_distribution<int64_t>(minMs_, maxMs_)(rng);
+    }
+
+private:
+    int64_t minMs_;
+    int64_t maxMs_;
+};
+
+// The usual shape of real call lengths: most are short, a few very long.
+// Half the calls are shorter than medianMs; sigma sets the tail.
+class LognormalServiceTime : public ServiceTime {
+public:
+    LognormalServiceTime(double medianMs, double sigma) : mu_(std::log(medianMs)), sigma_(sigma) {}
+
+    int64_t sampleMs(CallRandom& rng) const override {
+        return std::llround(std::lognormal_distribution<double>(mu_, sigma_)(rng));
+    }
+
+    double meanMs() const { return std::exp(mu_ + sigma_ * sigma_ / 2); }
+
+private:
+    double mu_;
+    double sigma_;
+};
+
+// Draws from recorded call lengths, each equally likely
+class EmpiricalServiceTime : public ServiceTime {
+public:
+    explicit EmpiricalServiceTime(std::vector<int64_t> samplesMs) : samplesMs_(std::move(samplesMs)) {
+        if (samplesMs_.empty()) {
+            throw std::invalid_argument("EmpiricalServiceTime needs at least one sample");
+        }
+    }
+
+    int64_t sampleMs(CallRandom& rng) const override {
+        return samplesMs_[std::uniform_int_distribution<size_t>(0, samplesMs_.size() - 1)(rng)];
+    }
+
+private:
+    std::vector<int64_t> samplesMs_;
+};
+
+enum class Priority { Vip, Normal };
+
+// What a client asks for when it calls
+struct CallRequest {
+    int clientId;
+    int maxWaitTime = 1000;  // milliseconds the client waits for an operator
+    int64_t serviceMs = -1;  // how long the call lasts; a draw from the service times if negative
+    int skill = 0;           // for routers that match skills
+    Priority priority = Priority::Normal;
+};
+
+// How a call ended
+struct CallResult {
+    bool served;
+    int operatorId;  // -1 if the client hung up
+    int64_t waitMs;  // until an operator answered or the client hung up
+};
+
+// Decides which free operator a client gets, and which waiting client a
+// freed operator serves. Operators are numbered 0..operatorCount()-1 and a
+// queued client is known by its ticket, which may be reused once the client
+// has been handed an operator or cancelled. Not thread-safe; CallCenter
+// calls it under its lock.
+class Router {
+public:
+    virtual ~Router() = default;
+
+    virtual int operatorCount() const = 0;
+
+    // Claims a free operator for the request, or returns -1
+    virtual int claimOperator(const CallRequest& request) = 0;
+
+    // Queues a client who found no free operator; returns its ticket
+    virtual int enqueue(const CallRequest& request, int64_t nowMs) = 0;
+
+    // A client who hangs up while still queued
+    virtual void cancel(int ticket) = 0;
+
+    // Hands an operator who finished a call to the next client it serves and
+    // returns that client's ticket; returns -1, and frees the operator, if
+    // there is none
+    virtual int releaseOperator(int op) = 0;
+};
+
+// Any operator for any client, in arrival order
+class FifoRouter : public Router {
+public:
+    explicit FifoRouter(int operatorCount) : operatorCount_(operatorCount) {
+        for (int i = operatorCount - 1; i >= 0; --i) {
+            freeOperators_.push_back(i);
+        }
+    }
+
+    int operatorCount() const override { return operatorCount_; }
+
+    int claimOperator(const CallRequest&) override {
+        if (freeOperators_.empty()) {
+            return -1;
+        }
+        int op = freeOperators_.back();
+        freeOperators_.pop_back();
+        return op;
+    }
+
+    int enqueue(const CallRequest&, int64_t) override {
+        int ticket;
+        if (!freeTickets_.empty()) {
+            ticket = freeTickets_.back();
+            freeTickets_.pop_back();
+        }
+        else {
+            ticket = static_cast<int>(cancelled_.size());
+            cancelled_.push_back(false);
+        }
+        cancelled_[ticket] = false;
+        waiting_.push_back(ticket);
+        return ticket;
+    }
+
+    // Left in the queue and skipped when it reaches the front, so cancelling
+    // is O(1); the ticket is reused from then on
+    void cancel(int ticket) override { cancelled_[ticket] = true; }
+
+    int releaseOperator(int op) override {
+        while (!waiting_.empty()) {
+            int ticket = waiting_.front();
+            waiting_.pop_front();
+            freeTickets_.push_back(ticket);
+            if (!cancelled_[ticket]) {
+                return ticket;
+            }
+        }
+        freeOperators_.push_back(op);
+        return -1;
+    }
+
+private:
+    int operatorCount_;
+    std::vector<int> freeOperators_;  // the most recently freed last
+    std::deque<int> waiting_;  // longest-waiting client first
+    std::vector<bool> cancelled_;  // by ticket
+    std::vector<int> freeTickets_;
+};
+
+// CallCenter class
+//
+// Free operators are taken first, then clients queue, and a client hangs up
+// at its deadline; the router decides who gets which operator, by default
+// in arrival order. Every wait and every call is a timer on the clock rather
+// than a blocked thread: on a WallClock calls take real time, and on a
+// SimulatedClock a day of traffic runs in seconds and the seed fixes every
+// result.
+class CallCenter {
+public:
+    // Runs on a WallClock of its own. Calls last between minServeDuration and
+    // maxServeDuration milliseconds.
+    CallCenter(int operatorCount, int minServeDuration = 1000, int maxServeDuration = 3000)
+        : CallCenter(operatorCount, std::make_shared<UniformServiceTime>(minServeDuration, maxServeDuration),
+                     std::random_device{}()) {}
+
+    CallCenter(int operatorCount, std::shared_ptr<const ServiceTime> serviceTime, uint64_t seed)
+        : CallCenter(std::make_unique<WallClock>(), operatorCount, std::move(serviceTime), seed) {}
+
+    CallCenter(Clock& clock, int operatorCount, int minServeDuration, int maxServeDuration, uint64_t seed)
+        : CallCenter(clock, operatorCount, std::make_shared<UniformServiceTime>(minServeDuration, maxServeDuration),
+                     seed) {}
+
+    CallCenter(Clock& clock, int operatorCount, std::shared_ptr<const ServiceTime> serviceTime, uint64_t seed)
+        : CallCenter(clock, std::make_unique<FifoRouter>(operatorCount), std::move(serviceTime), seed) {}
+
+    CallCenter(Clock& clock, std::unique_ptr<Router> router, std::shared_ptr<const ServiceTime> serviceTime,
+               uint64_t seed)
+        : clock_(clock), router_(std::move(router)), stats_(clock), serviceTime_(std::move(serviceTime)), rng_(seed) {
+        for (int i = 0; i < router_->operatorCount(); ++i) {
+            operators_.emplace_back(std::make_unique<Operator>(i, clock_));
+        }
+    }
+
+    // A clock of its own stops first, so no timer fires into a call center
+    // that is half gone. On a shared clock, calls still in progress must
+    // end first: the end of a call is a timer that calls back into here.
+    ~CallCenter() { ownClock_.reset(); }
+
+    CallCenter(const CallCenter&) = delete;
+    CallCenter& operator=(const CallCenter&) = delete;
+
+    // Starts a call and returns at once. `done` runs on the clock's thread
+    // when the call ends or the client hangs up. On a SimulatedClock, call
+    // from the clock's thread: from a callback, or before the clock runs. A
+    // request the router rejects throws, and the call never starts.
+    void call(const CallRequest& request, std::function<void(const CallResult&)> done = nullptr) {
+        auto caller = std::make_shared<Caller>(Caller{ request, std::move(done), clock_.nowMs() });
+        Operator* op;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            op = claimOperator(request);
+            if (op) {
+                caller->finished = true;
+            }
+            else {
+                caller->ticket = router_->enqueue(request, caller->arrivedMs);
+                if (static_cast<size_t>(caller->ticket) >= queued_.size()) {
+                    queued_.resize(caller->ticket + 1);
+                }
+                queued_[caller->ticket] = caller;
+                caller->hangUpTimer = clock_.schedule(request.maxWaitTime, [this, caller]() { hangUp(*caller); });
+            }
+        }
+        // Logged outside the lock, so a full log queue never holds up dispatch
+        if (op) {
+            answer(std::move(caller), *op);
+        }
+        else {
+            log("Client {} is waiting...", request.clientId);
+        }
+    }
+
+    // Waits up to maxWaitTime milliseconds for an operator and returns once
+    // the call is over; false if the client hung up. Needs a clock that runs
+    // on its own thread, such as a WallClock.
+    bool clientCall(int clientId, int maxWaitTime = 1000) {
+        std::promise<bool> served;
+        std::future<bool> result = served.get_future();
+        call({ clientId, maxWaitTime }, [&served](const CallResult& call) { served.set_value(call.served); });
+        return result.get();
+    }
+
+    int operatorCount() const { return static_cast<int>(operators_.size()); }
+
+    // Waits, hang-ups and call lengths since the CallCenter opened
+    const CallStats& stats() const { return stats_; }
+
+private:
+    struct Caller {
+        CallRequest request;
+        std::function<void(const CallResult&)> done;
+        int64_t arrivedMs;
+        int ticket = -1;        // the router's, while queued
+        uint64_t hangUpTimer = 0;  // while queued; cancelled once answered
+        bool finished = false;  // answered or hung up; guarded by mtx_
+    };
+
+    std::unique_ptr<WallClock> ownClock_;
+    Clock& clock_;
+    std::unique_ptr<Router> router_;
+    std::vector<std::unique_ptr<Operator>> operators_;
+    CallStats stats_;
+    std::vector<std::shared_ptr<Caller>> queued_;  // by router ticket
+    std::mutex mtx_;  // guards router_ and queued_
+    std::shared_ptr<const ServiceTime> serviceTime_;
+    RandomStreams rng_;
+
+    CallCenter(std::unique_ptr<WallClock> clock, int operatorCount, std::shared_ptr<const ServiceTime> serviceTime,
+               uint64_t seed)
+        : CallCenter(*clock, operatorCount, std::move(serviceTime), seed) {
+        ownClock_ = std::move(clock);
+    }
+
+    // Caller holds mtx_
+    Operator* claimOperator(const CallRequest& request) {
+        int id = router_->claimOperator(request);
+        if (id < 0) {
+            return nullptr;
+        }
+        operators_[id]->setBusy(true);
+        return operators_[id].get();
+    }
+
+    // The client keeps the operator from here until the call ends. The
+    // caller is already marked finished, under mtx_; this runs without it.
+    void answer(std::shared_ptr<Caller> caller, Operator& op) {
+        int64_t answeredMs = clock_.nowMs();
+        int clientId = caller->request.clientId;
+        int64_t serviceMs = caller->request.serviceMs >= 0 ? caller->request.serviceMs : getRandomServeDuration(clientId);
+        op.serveClient(clientId, serviceMs, [this, caller = std::move(caller), &op, answeredMs]() {
+            releaseOperator(op);
+            int64_t waitMs = answeredMs - caller->arrivedMs;
+            stats_.recordServed(std::chrono::milliseconds(waitMs), std::chrono::milliseconds(clock_.nowMs() - answeredMs));
+            if (caller->done) caller->done({ true, op.id(), waitMs });
+        });
+    }
+
+    void hangUp(Caller& caller) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (caller.finished) return;
+            caller.finished = true;
+            router_->cancel(caller.ticket);
+            queued_[caller.ticket] = nullptr;
+        }
+        int64_t waitMs = clock_.nowMs() - caller.arrivedMs;
+        stats_.recordAbandoned(std::chrono::milliseconds(waitMs));
+        log("Client {} hung up after waiting too long.", caller.request.clientId);
+        if (caller.done) caller.done({ false, -1, waitMs });
+    }
+
+    // The operator goes straight to the next client the router picks, still
+    // busy, or is free again if nobody it can serve is waiting
+    void releaseOperator(Operator& op) {
+        std::shared_ptr<Caller> next;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            int ticket = router_->releaseOperator(op.id());
+            if (ticket < 0) {
+                op.setBusy(false);
+                return;
+            }
+            next = std::move(queued_[ticket]);
+            next->finished = true;
+            clock_.cancel(next->hangUpTimer);
+        }
+        answer(std::move(next), op);
+    }
+
+    int64_t getRandomServeDuration(int clientId) {
+        CallRandom rng = rng_.forClient(clientId);
+        return serviceTime_->sampleMs(rng);
+    }
+};
+
+// One client of a workload: how long after the previous client it calls,
+// and, where a trace recorded them, how long its call lasts and how long it
+// is willing to wait; -1 leaves those to the call center
+struct CallArrival {
+    int64_t gapMs = 0;
+    int64_t serviceMs = -1;
+    int maxWaitMs = -1;
+};
+
+// Where clients come from. Drawn from one thread, in order.
+class ArrivalProcess {
+public:
+    virtual ~ArrivalProcess() = default;
+
+    // Fills in the next client; false once there are no more
+    virtual bool next(std::mt19937_64& rng, CallArrival& call) = 0;
+};
+
+// callCount clients at callsPerSecond on average, independently of each other
+class PoissonProcess : public ArrivalProcess {
+public:
+    PoissonProcess(double callsPerSecond, int callCount) : remaining_(callCount), gapMs_(callsPerSecond / 1000.0) {}
+
+    bool next(std::mt19937_64& rng, CallArrival& call) override {
+        if (remaining_-- <= 0) return false;
+        call = CallArrival{ std::llround(gapMs_(rng)) };
+        return true;
+    }
+
+private:
+    int remaining_;
+    std::exponential_distribution<double> gapMs_;
+};
+
+// Calm spells broken by bursts: a Poisson process whose rate switches
+// between calmCallsPerSecond and burstCallsPerSecond, with both states
+// lasting an exponentially distributed time of the given mean
+class BurstyProcess : public ArrivalProcess {
+public:
+    BurstyProcess(double calmCallsPerSecond, double burstCallsPerSecond, double meanCalmMs, double meanBurstMs,
+                  int callCount)
+        : remaining_(callCount), calmRate_(calmCallsPerSecond / 1000.0), burstRate_(burstCallsPerSecond / 1000.0),
+          meanCalmMs_(meanCalmMs), meanBurstMs_(meanBurstMs) {}
+
+    // Average over calm spells and bursts
+    double callsPerSecond() const {
+        return 1000.0 * (calmRate_ * meanCalmMs_ + burstRate_ * meanBurstMs_) / (meanCalmMs_ + meanBurstMs_);
+    }
+
+    bool next(std::mt19937_64& rng, CallArrival& call) override {
+        if (remaining_-- <= 0) return false;
+        if (untilSwitchMs_ < 0) {
+            untilSwitchMs_ = std::exponential_distribution<double>(1.0 / meanCalmMs_)(rng);
+        }
+        // Arrivals are memoryless, so a gap cut short by a switch simply
+        // starts over at the new rate
+        double gapMs = 0;
+        while (true) {
+            double candidate = std::exponential_distribution<double>(bursting_ ? burstRate_ : calmRate_)(rng);
+            if (candidate < untilSwitchMs_) {
+                untilSwitchMs_ -= candidate;
+                gapMs += candidate;
+                break;
+            }
+            gapMs += untilSwitchMs_;
+            bursting_ = !bursting_;
+            untilSwitchMs_ = std::exponential_distribution<double>(1.0 / (bursting_ ? meanBurstMs_ : meanCalmMs_))(rng);
+        }
+        call = CallArrival{ std::llround(gapMs) };
+        return true;
+    }
+
+private:
+    int remaining_;
+    double calmRate_;   // calls per millisecond
+    double burstRate_;
+    double meanCalmMs_;
+    double meanBurstMs_;
+    bool bursting_ = false;
+    double untilSwitchMs_ = -1;
+};
+
+// Calls recorded from real traffic, replayed as they came. The CSV has one
+// call per line: arrival_ms,service_ms[,max_wait_ms], with arrival times
+// counted from any fixed point and in order. A header line and blank lines
+// are skipped.
+class TraceReplay : public ArrivalProcess {
+public:
+    struct TraceCall {
+        int64_t arrivalMs;
+        int64_t serviceMs;
+        int maxWaitMs;  // -1 if not recorded
+    };
+
+    explicit TraceReplay(std::vector<TraceCall> calls) : calls_(std::move(calls)) {}
+
+    static TraceReplay loadCsv(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("cannot open trace " + path);
+        }
+        return parseCsv(in, path);
+    }
+
+    static TraceReplay parseCsv(std::istream& in, const std::string& name = "trace") {
+        std::vector<TraceCall> calls;
+        std::string line;
+        for (int lineNumber = 1; std::getline(in, line); ++lineNumber) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty()) continue;
+            std::vector<int64_t> fields;
+            if (!parseFields(line, fields)) {
+                if (lineNumber == 1) continue;  // header
+                throw std::runtime_error(fmt::format("{}:{}: expected arrival_ms,service_ms[,max_wait_ms]", name, lineNumber));
+            }
+            if (fields.size() < 2 || fields.size() > 3 || fields[1] < 0 ||
+                (fields.size() == 3 && (fields[2] < 0 || fields[2] > std::numeric_limits<int>::max()))) {
+                throw std::runtime_error(fmt::format("{}:{}: expected arrival_ms,service_ms[,max_wait_ms]", name, lineNumber));
+            }
+            if (!calls.empty() && fields[0] < calls.back().arrivalMs) {
+                throw std::runtime_error(fmt::format("{}:{}: arrivals out of order", name, lineNumber));
+            }
+            calls.push_back({ fields[0], fields[1], fields.size() == 3 ? static_cast<int>(fields[2]) : -1 });
+        }
+        return TraceReplay(std::move(calls));
+    }
+
+    size_t size() const { return calls_.size(); }
+
+    // Sum of the recorded call lengths
+    int64_t totalServiceMs() const {
+        int64_t total = 0;
+        for (const TraceCall& call : calls_) {
+            total += call.serviceMs;
+        }
+        return total;
+    }
+
+    int64_t spanMs() const { return calls_.empty() ? 0 : calls_.back().arrivalMs - calls_.front().arrivalMs; }
+
+    bool next(std::mt19937_64&, CallArrival& call) override {
+        if (next_ == calls_.size()) return false;
+        const TraceCall& recorded = calls_[next_];
+        call = CallArrival{ next_ == 0 ? 0 : recorded.arrivalMs - calls_[next_ - 1].arrivalMs,
+                            recorded.serviceMs, recorded.maxWaitMs };
+        ++next_;
+        return true;
+    }
+
+private:
+    std::vector<TraceCall> calls_;
+    size_t next_ = 0;
+
+    static bool parseFields(const std::string& line, std::vector<int64_t>& fields) {
+        const char* at = line.data();
+        const char* end = line.data() + line.size();
+        while (true) {
+            while (at < end && *at == ' ') ++at;
+            int64_t value;
+            auto [rest, error] = std::from_chars(at, end, value);
+            if (error != std::errc()) return false;
+            fields.push_back(value);
+            at = rest;
+            while (at < end && *at == ' ') ++at;
+            if (at == end) return true;
+            if (*at++ != ',') return false;
+        }
+    }
+};
+
+// Feeds a workload into a call center, one arrival scheduled at a time
+struct ScheduledArrivals {
+    Clock& clock;
+    CallCenter& callCenter;
+    std::shared_ptr<ArrivalProcess> process;
+    int maxWaitTime;
+    std::mt19937_64 rng;
+    int nextId = 0;
+};
+
+// Each pending arrival holds the workload, so it lives until the last one
+void scheduleNextArrival(const std::shared_ptr<ScheduledArrivals>& arrivals) {
+    CallArrival call;
+    if (!arrivals->process->next(arrivals->rng, call)) return;
+    arrivals->clock.schedule(call.gapMs, [arrivals, call]() {
+        int maxWaitTime = call.maxWaitMs >= 0 ? call.maxWaitMs : arrivals->maxWaitTime;
+        arrivals->callCenter.call({ arrivals->nextId++, maxWaitTime, call.serviceMs });
+        scheduleNextArrival(arrivals);
+    });
+}
+
+// Clients who do not say how long they wait wait up to maxWaitTime
+void scheduleArrivals(Clock& clock, CallCenter& callCenter, std::shared_ptr<ArrivalProcess> process,
+                      int maxWaitTime, uint64_t seed) {
+    scheduleNextArrival(std::make_shared<ScheduledArrivals>(ScheduledArrivals{
+        clock, callCenter, std::move(process), maxWaitTime, std::mt19937_64(seed) }));
+}
+
+// Feeds callCount clients into the call center at callsPerSecond on average
+void scheduleArrivals(Clock& clock, CallCenter& callCenter, int callCount, double callsPerSecond,
+                      int maxWaitTime, uint64_t seed) {
+    scheduleArrivals(clock, callCenter, std::make_shared<PoissonProcess>(callsPerSecond, callCount), maxWaitTime,
+                     seed);
+}
+
+// Runs coroutines on a few threads. Each worker has its own deque: it
+// resumes its newest task first, while it is hot in cache, and an idle
+// worker steals the oldest task of another. Tasks posted from outside the
+// pool are spread over the workers in turn.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int threadCount) {
+        for (int i = 0; i < threadCount; ++i) {
+            workers_.emplace_back(std::make_unique<Worker>());
+        }
+        for (int i = 0; i < threadCount; ++i) {
+            threads_.emplace_back(&WorkStealingPool::run, this, i);
+        }
+    }
+
+    // Tasks still queued are never resumed, and their frames leak; callers
+    // wait for their coroutines to finish first
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(idleMtx_);
+            stopping_ = true;
+        }
+        idle_.notify_all();
+        for (auto& th : threads_) {
+            th.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    int threadCount() const { return static_cast<int>(threads_.size()); }
+
+    void post(std::coroutine_handle<> task) {
+        int index = currentPool_ == this ? currentIndex_
+                                         : static_cast<int>(nextWorker_.fetch_add(1, std::memory_order_relaxed) % workers_.size());
+        {
+            std::lock_guard<std::mutex> lock(workers_[index]->mtx);
+            workers_[index]->tasks.push_back(task);
+        }
+        // Counting the task before looking for sleepers, and a worker counting
+        // itself asleep before looking for tasks, means one sees the other
+        pending_.fetch_add(1, std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_seq_cst) > 0) {
+            std::lock_guard<std::mutex> lock(idleMtx_);
+            idle_.notify_one();
+        }
+    }
+
+    // co_await pool.schedule() moves the coroutine onto the pool
+    auto schedule() {
+        struct Awaiter {
+            WorkStealingPool& pool;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> task) { pool.post(task); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{ *this };
+    }
+
+private:
+    struct Worker {
+        std::mutex mtx;
+        std::deque<std::coroutine_handle<>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<unsigned> nextWorker_{ 0 };
+    std::atomic<int> pending_{ 0 };   // tasks in all deques
+    std::atomic<int> sleepers_{ 0 };
+    std::mutex idleMtx_;
+    std::condition_variable idle_;
+    bool stopping_ = false;
+
+    static thread_local WorkStealingPool* currentPool_;
+    static thread_local int currentIndex_;
+
+    std::coroutine_handle<> take(int index) {
+        {
+            Worker& own = *workers_[index];
+            std::lock_guard<std::mutex> lock(own.mtx);
+            if (!own.tasks.empty()) {
+                std::coroutine_handle<> task = own.tasks.back();
+                own.tasks.pop_back();
+                return task;
             }
-            catch (const spdlog::spdlog_ex& ex) {
-                std::cerr << "Log initialization failed: " << ex.what() << std::endl;
+        }
+        for (size_t i = 1; i < workers_.size(); ++i) {
+            Worker& victim = *workers_[(index + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock(victim.mtx);
+            if (!victim.tasks.empty()) {
+                std::coroutine_handle<> task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    void run(int index) {
+        currentPool_ = this;
+        currentIndex_ = index;
+        while (true) {
+            if (std::coroutine_handle<> task = take(index)) {
+                pending_.fetch_sub(1, std::memory_order_relaxed);
+                task.resume();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idleMtx_);
+            sleepers_.fetch_add(1, std::memory_order_seq_cst);
+            idle_.wait(lock, [this] { return stopping_ || pending_.load(std::memory_order_seq_cst) > 0; });
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            if (stopping_) {
+                return;
             }
         }
-        return logger;
     }
 };
 
-// Logging function using the static logger instance directly
-void log(const std::string& message) {
-    Logger::getInstance()->info(message);
-}
+thread_local WorkStealingPool* WorkStealingPool::currentPool_ = nullptr;
+thread_local int WorkStealingPool::currentIndex_ = 0;
 
-// Operator class
-class Operator {
+// Coroutine that runs on its own once started and frees its frame when it
+// finishes; nothing waits for it
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+// CallCenter with its callers as coroutines on a WorkStealingPool: a
+// waiting client is a suspended coroutine and a call in progress is a timer,
+// so the number of callers is bounded by memory, not by threads. Routing,
+// hang-ups, service times and stats are the CallCenter's.
+//
+// The pool only resumes coroutines; every wait and every call runs on the
+// clock's timer thread. Calls are placed from the pool's threads, so the
+// clock is a WallClock: a SimulatedClock may only be used from one thread.
+class AsyncCallCenter {
 public:
-    Operator(int id) : id_(id), is_busy_(false) {}
+    AsyncCallCenter(WorkStealingPool& pool, WallClock& clock, int operatorCount, int minServeDuration,
+                    int maxServeDuration)
+        : AsyncCallCenter(pool, clock, operatorCount,
+                          std::make_shared<UniformServiceTime>(minServeDuration, maxServeDuration), std::random_device{}()) {}
 
-    Operator(const Operator&) = delete;
-    Operator& operator=(const Operator&) = delete;
+    AsyncCallCenter(WorkStealingPool& pool, WallClock& clock, int operatorCount,
+                    std::shared_ptr<const ServiceTime> serviceTime, uint64_t seed)
+        : pool_(pool), callCenter_(clock, operatorCount, std::move(serviceTime), seed) {}
 
-    bool isBusy() const { return is_busy_; }
+    // co_await call(request) suspends the coroutine until the call ends or
+    // the client hangs up, and resumes it on the pool; no thread is held
+    // meanwhile
+    auto call(const CallRequest& request) {
+        struct Awaiter {
+            AsyncCallCenter& center;
+            CallRequest request;
+            CallResult result;
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> caller) {
+                WorkStealingPool& pool = center.pool_;
+                // The coroutine may be resumed on another thread before this
+                // returns, so nothing is touched after the call is placed
+                center.callCenter_.call(request, [this, &pool, caller](const CallResult& ended) {
+                    result = ended;
+                    pool.post(caller);
+                });
+            }
+
+            CallResult await_resume() const noexcept { return result; }
+        };
+        return Awaiter{ *this, request, CallResult{ false, -1, 0 } };
+    }
+
+    // One client's call, from dialing until it is served or hangs up after
+    // maxWaitTime milliseconds; returns once the call is under way
+    DetachedTask clientCall(int clientId, int maxWaitTime = 1000) {
+        activeCalls_.fetch_add(1, std::memory_order_relaxed);
+        co_await pool_.schedule();
+        co_await call({ clientId, maxWaitTime });
+        finishCall();
+    }
 
-    void serveClient(int clientId, int serveDuration) {
-        is_busy_ = true;
-        log("Operator " + std::to_string(id_) + " is serving client " + std::to_string(clientId));
-        std::this_thread::sleep_for(std::chrono::milliseconds(serveDuration));
-        log("Operator " + std::to_string(id_) + " finished serving client " + std::to_string(clientId));
-        is_busy_ = false;
+    // Blocks the calling thread until every call started so far has ended
+    void waitUntilIdle() {
+        std::unique_lock<std::mutex> lock(idleMtx_);
+        idle_.wait(lock, [this] { return activeCalls_.load() == 0; });
     }
 
+    const CallStats& stats() const { return callCenter_.stats(); }
+
 private:
-    int id_;
-    std::atomic<bool> is_busy_;
+    WorkStealingPool& pool_;
+    CallCenter callCenter_;
+    std::atomic<int> activeCalls_{ 0 };
+    std::mutex idleMtx_;
+    std::condition_variable idle_;
+
+    void finishCall() {
+        if (activeCalls_.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(idleMtx_);
+            idle_.notify_all();
+        }
+    }
 };
 
-// CallCenter class
-class CallCenter {
+// Binary min-heap of ids 0..n-1, each with a key, that can also find and
+// remove any id in O(log n)
+template <typename Key>
+class IndexedHeap {
 public:
-    CallCenter(int operatorCount) {
-        for (int i = 0; i < operatorCount; ++i) {
-            operators_.emplace_back(std::make_unique<Operator>(i));
+    bool empty() const { return heap_.empty(); }
+    size_t size() const { return heap_.size(); }
+    int top() const { return heap_.front().second; }
+    const Key& topKey() const { return heap_.front().first; }
+
+    bool contains(int id) const {
+        return static_cast<size_t>(id) < position_.size() && position_[id] != NOT_QUEUED;
+    }
+
+    void push(int id, const Key& key) {
+        if (static_cast<size_t>(id) >= position_.size()) {
+            position_.resize(id + 1, NOT_QUEUED);
+        }
+        heap_.emplace_back(key, id);
+        position_[id] = heap_.size() - 1;
+        siftUp(heap_.size() - 1);
+    }
+
+    void erase(int id) {
+        size_t at = position_[id];
+        position_[id] = NOT_QUEUED;
+        if (at + 1 == heap_.size()) {
+            heap_.pop_back();
+            return;
+        }
+        heap_[at] = std::move(heap_.back());
+        heap_.pop_back();
+        position_[heap_[at].second] = at;
+        siftDown(siftUp(at));
+    }
+
+    int pop() {
+        int id = top();
+        erase(id);
+        return id;
+    }
+
+private:
+    static constexpr size_t NOT_QUEUED = static_cast<size_t>(-1);
+
+    std::vector<std::pair<Key, int>> heap_;
+    std::vector<size_t> position_;  // by id
+
+    void place(size_t at, std::pair<Key, int> entry) {
+        position_[entry.second] = at;
+        heap_[at] = std::move(entry);
+    }
+
+    size_t siftUp(size_t at) {
+        std::pair<Key, int> entry = std::move(heap_[at]);
+        while (at > 0 && entry.first < heap_[(at - 1) / 2].first) {
+            place(at, std::move(heap_[(at - 1) / 2]));
+            at = (at - 1) / 2;
         }
+        place(at, std::move(entry));
+        return at;
     }
 
-    void clientCall(int clientId, int maxWaitTime = 1000, int retryDelay = 500) {
-        int attempts = 0;
+    void siftDown(size_t at) {
+        std::pair<Key, int> entry = std::move(heap_[at]);
         while (true) {
-            Operator* availableOperator = getAvailableOperator();
-            if (availableOperator) {
-                int serveDuration = getRandomServeDuration();
-                availableOperator->serveClient(clientId, serveDuration);
-                break;
-            }
-            else {
-                if (attempts++ * retryDelay >= maxWaitTime) {
-                    log("Client " + std::to_string(clientId) + " hung up after waiting too long.");
-                    return;
-                }
-                log("Client " + std::to_string(clientId) + " is waiting...");
-                std::this_thread::sleep_for(std::chrono::milliseconds(retryDelay));
+            size_t child = 2 * at + 1;
+            if (child >= heap_.size()) break;
+            if (child + 1 < heap_.size() && heap_[child + 1].first < heap_[child].first) ++child;
+            if (!(heap_[child].first < entry.first)) break;
+            place(at, std::move(heap_[child]));
+            at = child;
+        }
+        place(at, std::move(entry));
+    }
+};
+
+// Skills are numbered 0..63; an operator has a set of them
+using SkillSet = uint64_t;
+const int MAX_SKILLS = 64;
+
+inline void checkSkill(int skill) {
+    if (skill < 0 || skill >= MAX_SKILLS) {
+        throw std::invalid_argument(fmt::format("skill {} is not in 0..{}", skill, MAX_SKILLS - 1));
+    }
+}
+
+inline SkillSet skillSet(std::initializer_list<int> skills) {
+    SkillSet set = 0;
+    for (int skill : skills) {
+        checkSkill(skill);
+        set |= SkillSet(1) << skill;
+    }
+    return set;
+}
+
+// Routes by skill: each operator has skills, and each client needs one
+// skill and is a VIP or not.
+//
+// Each skill has a heap of the free operators who have it, best match
+// first: the operator with the fewest skills, so generalists stay free for
+// callers only they can serve, and then the one idle longest. Each skill
+// also has a heap of the callers waiting for it. A caller's place is its
+// arrival time, less a fixed head start for VIPs, so callers of one class
+// keep their arrival order, a VIP goes ahead of normal callers who arrived
+// less than the head start before, and no normal caller waits behind VIPs
+// who arrived more than the head start after it. Places never change while
+// callers wait, so every operation is O(log n) per skill involved. A skill
+// outside 0..63 is rejected with std::invalid_argument before anything
+// changes.
+class SkillRouter : public Router {
+public:
+    SkillRouter(const std::vector<SkillSet>& operatorSkills, int64_t vipHeadStartMs)
+        : operatorSkills_(operatorSkills), vipHeadStartMs_(vipHeadStartMs),
+          freeOperators_(MAX_SKILLS), waiting_(MAX_SKILLS) {
+        for (int op = 0; op < static_cast<int>(operatorSkills_.size()); ++op) {
+            addFreeOperator(op);
+        }
+    }
+
+    int operatorCount() const override { return static_cast<int>(operatorSkills_.size()); }
+
+    int claimOperator(const CallRequest& request) override { return claimOperator(request.skill); }
+
+    int enqueue(const CallRequest& request, int64_t nowMs) override {
+        return enqueue(request.skill, request.priority, nowMs);
+    }
+
+    // Claims the best free operator with `skill`, or returns -1
+    int claimOperator(int skill) {
+        checkSkill(skill);
+        if (freeOperators_[skill].empty()) {
+            return -1;
+        }
+        int op = freeOperators_[skill].top();
+        forEachSkill(operatorSkills_[op], [&](int s) { freeOperators_[s].erase(op); });
+        return op;
+    }
+
+    // Queues a caller who found no free operator; returns its ticket
+    int enqueue(int skill, Priority priority, int64_t nowMs) {
+        checkSkill(skill);
+        int ticket;
+        if (!freeTickets_.empty()) {
+            ticket = freeTickets_.back();
+            freeTickets_.pop_back();
+        }
+        else {
+            ticket = static_cast<int>(ticketSkill_.size());
+            ticketSkill_.push_back(0);
+        }
+        ticketSkill_[ticket] = skill;
+        int64_t place = priority == Priority::Vip ? nowMs - vipHeadStartMs_ : nowMs;
+        waiting_[skill].push(ticket, { place, nextSequence_++ });
+        return ticket;
+    }
+
+    void cancel(int ticket) override {
+        waiting_[ticketSkill_[ticket]].erase(ticket);
+        freeTickets_.push_back(ticket);
+    }
+
+    // The first caller waiting for any of the operator's skills
+    int releaseOperator(int op) override {
+        int ticket = -1;
+        const CallerKey* best = nullptr;
+        forEachSkill(operatorSkills_[op], [&](int s) {
+            if (!waiting_[s].empty() && (!best || waiting_[s].topKey() < *best)) {
+                best = &waiting_[s].topKey();
+                ticket = waiting_[s].top();
             }
+        });
+        if (ticket < 0) {
+            addFreeOperator(op);
+            return -1;
         }
+        waiting_[ticketSkill_[ticket]].erase(ticket);
+        freeTickets_.push_back(ticket);
+        return ticket;
+    }
+
+    size_t waiting(int skill) const {
+        checkSkill(skill);
+        return waiting_[skill].size();
     }
 
 private:
-    std::vector<std::unique_ptr<Operator>> operators_;
-    std::mutex mtx_;
+    using OperatorKey = std::pair<int, uint64_t>;   // skill count, freed sequence
+    using CallerKey = std::pair<int64_t, uint64_t>; // place in line, arrival sequence
 
-    Operator* getAvailableOperator() {
-        std::lock_guard<std::mutex> lock(mtx_);
-        for (auto& op : operators_) {
-            if (!op->isBusy()) {
-                return op.get();
-            }
+    std::vector<SkillSet> operatorSkills_;
+    int64_t vipHeadStartMs_;
+    std::vector<IndexedHeap<OperatorKey>> freeOperators_;  // by skill
+    std::vector<IndexedHeap<CallerKey>> waiting_;          // by skill
+    std::vector<int> ticketSkill_;
+    std::vector<int> freeTickets_;
+    uint64_t nextSequence_ = 0;
+
+    template <typename Visit>
+    static void forEachSkill(SkillSet skills, Visit&& visit) {
+        while (skills != 0) {
+            int skill = std::countr_zero(skills);
+            visit(skill);
+            skills &= skills - 1;
         }
-        return nullptr;
     }
 
-    int getRandomServeDuration() {
-        static std::mt19937 rng(std::random_device{}());
-        std::uniform_int_distribution<int> dist(1000, 3000);
-        return dist(rng);
+    void addFreeOperator(int op) {
+        OperatorKey key{ std::popcount(operatorSkills_[op]), nextSequence_++ };
+        forEachSkill(operatorSkills_[op], [&](int s) { freeOperators_[s].push(op, key); });
     }
 };
 
@@ -117,73 +1718,695 @@ private:
 class CallCenterTest : public ::testing::Test {
 protected:
     void SetUp() override {
-        call_center_ = new CallCenter(3);  // 3 operators
+        call_center_ = new CallCenter(clock_, 3, 1000, 3000, 2024);  // 3 operators
     }
 
     void TearDown() override {
         delete call_center_;
     }
 
+    SimulatedClock clock_;
     CallCenter* call_center_;
 };
 
 TEST_F(CallCenterTest, MultipleClients) {
-    std::vector<std::thread> clientThreads;
     for (int i = 0; i < 5; ++i) {
-        clientThreads.emplace_back([this, i]() { call_center_->clientCall(i); });
+        call_center_->call({ i });
     }
 
-    for (auto& th : clientThreads) {
-        th.join();
-    }
-    ASSERT_TRUE(true);
+    clock_.run();
+    CallStatsSnapshot stats = call_center_->stats().snapshot();
+    EXPECT_EQ(stats.calls(), 5u);
+    EXPECT_GE(stats.served(), 3u);  // one per operator at least
+    EXPECT_LE(stats.wait.max(), 1000u * 1000);
 }
 
 TEST_F(CallCenterTest, ClientsHangUpAfterWaiting) {
-    std::vector<std::thread> clientThreads;
     int numClients = 6;
     for (int i = 0; i < numClients; ++i) {
-        clientThreads.emplace_back([this, i]() { call_center_->clientCall(i, 2000, 500); });
+        call_center_->call({ i, 2000 });
     }
 
-    for (auto& th : clientThreads) {
-        th.join();
+    clock_.run();
+    CallStatsSnapshot stats = call_center_->stats().snapshot();
+    EXPECT_EQ(stats.calls(), static_cast<uint64_t>(numClients));
+    EXPECT_GE(stats.served(), 3u);
+    if (stats.abandoned() > 0) {
+        EXPECT_GE(stats.abandon.min(), 2000u * 1000);  // nobody hangs up early
     }
-    ASSERT_TRUE(true);
 }
 
 TEST_F(CallCenterTest, HighLoadTest) {
-    std::vector<std::thread> clientThreads;
     int numClients = 15;
 
     for (int i = 0; i < numClients; ++i) {
-        clientThreads.emplace_back([this, i]() { call_center_->clientCall(i, 3000, 300); });
+        call_center_->call({ i, 3000 });
     }
 
-    for (auto& th : clientThreads) {
-        th.join();
-    }
-    ASSERT_TRUE(true);
+    clock_.run();
+    CallStatsSnapshot stats = call_center_->stats().snapshot();
+    EXPECT_EQ(stats.calls(), static_cast<uint64_t>(numClients));
+    EXPECT_GT(stats.abandoned(), 0u);  // 15 clients, 3 operators, 1-3 s calls, 3 s patience
+    EXPECT_LE(stats.utilization(call_center_->operatorCount()), 1.0);
 }
 
 TEST_F(CallCenterTest, VariedClientWaitTimes) {
-    std::vector<std::thread> clientThreads;
     int numClients = 8;
     for (int i = 0; i < numClients; ++i) {
         int waitTime = 1000 + i * 500;
-        clientThreads.emplace_back([this, i, waitTime]() { call_center_->clientCall(i, waitTime, 200); });
+        call_center_->call({ i, waitTime });
+    }
+
+    clock_.run();
+    CallStatsSnapshot stats = call_center_->stats().snapshot();
+    EXPECT_EQ(stats.calls(), static_cast<uint64_t>(numClients));
+    EXPECT_LE(stats.wait.max(), static_cast<uint64_t>(1000 + (numClients - 1) * 500) * 1000);
+}
+
+TEST(CallCenterQueueTest, WaitingClientsAreServedInArrivalOrder) {
+    SimulatedClock clock;
+    CallCenter callCenter(clock, 1, 50, 50, 1);
+    std::vector<int> order;
+    for (int i = 0; i < 5; ++i) {
+        clock.schedule(i * 10, [&, i]() {
+            callCenter.call({ i, 5000 }, [&order, i](const CallResult& result) {
+                EXPECT_TRUE(result.served);
+                order.push_back(i);
+            });
+        });
+    }
+    clock.run();
+
+    EXPECT_EQ(order, (std::vector<int>{ 0, 1, 2, 3, 4 }));
+}
+
+TEST(CallCenterQueueTest, FreedOperatorGoesStraightToWaitingClient) {
+    SimulatedClock clock;
+    CallCenter callCenter(clock, 1, 100, 100, 1);
+    std::vector<CallResult> results;
+    int64_t secondEndedMs = -1;
+    callCenter.call({ 0, 5000 }, [&](const CallResult& result) { results.push_back(result); });
+    clock.schedule(10, [&]() {
+        callCenter.call({ 1, 5000 }, [&](const CallResult& result) {
+            results.push_back(result);
+            secondEndedMs = clock.nowMs();
+        });
+    });
+    clock.run();
+
+    // Answered the moment the first call ends, so the calls run back to back
+    ASSERT_EQ(results.size(), 2u);
+    EXPECT_TRUE(results[1].served);
+    EXPECT_EQ(results[1].waitMs, 90);
+    EXPECT_EQ(secondEndedMs, 200);
+}
+
+TEST(CallCenterQueueTest, ClientHangsUpAtDeadline) {
+    SimulatedClock clock;
+    CallCenter callCenter(clock, 1, 300, 300, 1);
+    CallResult second{ true, 0, 0 };
+    int64_t hungUpMs = -1;
+    callCenter.call({ 0, 1000 });
+    clock.schedule(10, [&]() {
+        callCenter.call({ 1, 100 }, [&](const CallResult& result) {
+            second = result;
+            hungUpMs = clock.nowMs();
+        });
+    });
+    clock.run();
+
+    EXPECT_FALSE(second.served);
+    EXPECT_EQ(second.operatorId, -1);
+    EXPECT_EQ(second.waitMs, 100);
+    EXPECT_EQ(hungUpMs, 110);
+}
+
+// A client who is answered leaves no hang-up timer behind, so the clock can
+// outlive the call center
+TEST(CallCenterQueueTest, AnsweredClientLeavesNoTimer) {
+    SimulatedClock clock;
+    auto callCenter = std::make_unique<CallCenter>(clock, 1, 100, 100, 1);
+    bool served = false;
+    callCenter->call({ 0, 1000 });
+    clock.schedule(10, [&]() {
+        callCenter->call({ 1, 1000 }, [&](const CallResult& result) { served = result.served; });
+    });
+    clock.run();
+    EXPECT_TRUE(served);
+    EXPECT_EQ(clock.nowMs(), 200);  // the end of the second call, not its deadline at 1010
+
+    callCenter.reset();
+    bool ran = false;
+    uint64_t timer = clock.schedule(10, [&]() { ran = true; });
+    EXPECT_TRUE(clock.cancel(timer));
+    EXPECT_FALSE(clock.cancel(timer));
+    EXPECT_EQ(clock.run(), 0u);
+    EXPECT_FALSE(ran);
+}
+
+// Turns the log lines of every call off while a simulation of many calls runs
+class QuietLog {
+public:
+    QuietLog() { Logger::async().setEnabled(false); }
+    ~QuietLog() { Logger::async().setEnabled(true); }
+
+    QuietLog(const QuietLog&) = delete;
+    QuietLog& operator=(const QuietLog&) = delete;
+};
+
+TEST(SimulationTest, SameSeedGivesSameDay) {
+    QuietLog quiet;
+    auto simulate = [](uint64_t seed) {
+        SimulatedClock clock;
+        CallCenter callCenter(clock, 20, 1000, 3000, seed);
+        scheduleArrivals(clock, callCenter, 100000, 10.5, 30000, seed + 1);
+        clock.run();
+        return callCenter.stats().snapshot();
+    };
+    CallStatsSnapshot first = simulate(42);
+    CallStatsSnapshot again = simulate(42);
+    CallStatsSnapshot other = simulate(7);
+    EXPECT_EQ(first.calls(), 100000u);
+    EXPECT_EQ(first.served(), again.served());
+    EXPECT_EQ(first.abandoned(), again.abandoned());
+    EXPECT_EQ(first.wait.sum(), again.wait.sum());
+    EXPECT_EQ(first.service.sum(), again.service.sum());
+    EXPECT_NE(first.wait.sum(), other.wait.sum());
+}
+
+TEST(SimulationTest, FollowsCallCenterRules) {
+    SimulatedClock clock;
+    CallCenter callCenter(clock, 1, 100, 100, 1);
+    for (int i = 0; i < 3; ++i) {
+        callCenter.call({ i, 150 });
+    }
+    clock.run();
+
+    // Client 0 at once, client 1 when client 0 is done, client 2 hangs up
+    CallStatsSnapshot stats = callCenter.stats().snapshot();
+    EXPECT_EQ(stats.served(), 2u);
+    EXPECT_EQ(stats.abandoned(), 1u);
+    EXPECT_EQ(stats.wait.sum(), 100u * 1000);
+    EXPECT_EQ(stats.abandon.max(), 150u * 1000);
+    EXPECT_EQ(clock.nowMs(), 200);
+}
+
+// A benchmark, so it only prints; run it with --gtest_also_run_disabled_tests.
+// SameSeedGivesSameDay and FollowsCallCenterRules check the simulation.
+TEST(SimulationBenchmark, DISABLED_MillionCalls) {
+    QuietLog quiet;
+    auto start = std::chrono::steady_clock::now();
+    SimulatedClock clock;
+    CallCenter callCenter(clock, 50, 1000, 3000, 2024);
+    // About 96% occupancy, a bit over 11 hours of traffic
+    scheduleArrivals(clock, callCenter, 1000000, 24.0, 60000, 2025);
+    uint64_t events = clock.run();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+    CallStatsSnapshot stats = callCenter.stats().snapshot();
+    EXPECT_EQ(stats.calls(), 1000000u);
+    EXPECT_NEAR(stats.elapsedSeconds, clock.nowMs() / 1e3, 1e-9);
+    std::cout << "simulated_hours=" << clock.nowMs() / 3600000.0 << " events=" << events
+              << " served=" << stats.served() << " hung_up=" << stats.abandoned()
+              << " mean_wait_ms=" << stats.wait.mean() / 1e3 << " wall_ms=" << elapsed.count() << std::endl;
+}
+
+// The same call center in real time. The test waits for the last call to
+// end rather than for a fixed time, and only the order of events is
+// checked: client 1 is answered when client 0's 50 ms call ends, before its
+// own 75 ms deadline, and client 2 hangs up at its deadline.
+TEST(SimulationTest, SameCallCenterOnWallClock) {
+    WallClock clock;
+    CallCenter callCenter(clock, 1, 50, 50, 1);
+    std::mutex mtx;
+    std::condition_variable ended;
+    std::vector<CallResult> results;
+    clock.schedule(0, [&]() {
+        for (int i = 0; i < 3; ++i) {
+            callCenter.call({ i, 75 }, [&](const CallResult& result) {
+                std::lock_guard<std::mutex> lock(mtx);
+                results.push_back(result);
+                ended.notify_one();
+            });
+        }
+    });
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        ASSERT_TRUE(ended.wait_for(lock, std::chrono::seconds(10), [&] { return results.size() == 3; }));
+    }
+
+    CallStatsSnapshot stats = callCenter.stats().snapshot();
+    EXPECT_EQ(stats.served(), 2u);
+    EXPECT_EQ(stats.abandoned(), 1u);
+    EXPECT_GE(stats.wait.max(), 50u * 1000);
+    EXPECT_GE(stats.abandon.min(), 75u * 1000);
+}
+
+TEST(AsyncCallCenterTest, FollowsCallCenterRules) {
+    WallClock clock;
+    WorkStealingPool pool(2);
+    AsyncCallCenter callCenter(pool, clock, 1, 100, 100);
+    for (int i = 0; i < 3; ++i) {
+        callCenter.clientCall(i, 150);
+    }
+    callCenter.waitUntilIdle();
+
+    // One client at once, the next when that call is done, the last hangs
+    // up, in whatever order the pool places the calls
+    CallStatsSnapshot stats = callCenter.stats().snapshot();
+    EXPECT_EQ(stats.served(), 2u);
+    EXPECT_EQ(stats.abandoned(), 1u);
+    EXPECT_GE(stats.service.min(), 100u * 1000);
+}
+
+TEST(AsyncCallCenterTest, HundredThousandCallersOnFourThreads) {
+    QuietLog quiet;
+    WallClock clock;
+    WorkStealingPool pool(4);
+    AsyncCallCenter callCenter(pool, clock, 500, 2, 4);
+    const int callers = 100000;
+    for (int i = 0; i < callers; ++i) {
+        callCenter.clientCall(i, 60000);
+    }
+    callCenter.waitUntilIdle();
+
+    CallStatsSnapshot stats = callCenter.stats().snapshot();
+    EXPECT_EQ(stats.served(), static_cast<uint64_t>(callers));
+    EXPECT_EQ(stats.abandoned(), 0u);
+}
+
+// Holds every line until opened, so the flush thread stalls with the queue full
+class GateSink : public spdlog::sinks::base_sink<std::mutex> {
+public:
+    explicit GateSink(std::shared_future<void> gate) : gate_(std::move(gate)) {}
+    size_t written() const { return written_.load(); }
+
+protected:
+    void sink_it_(const spdlog::details::log_msg&) override {
+        gate_.wait();
+        ++written_;
+    }
+    void flush_() override {}
+
+private:
+    std::shared_future<void> gate_;
+    std::atomic<size_t> written_{ 0 };
+};
+
+TEST(AsyncLogTest, OverflowPolicies) {
+    std::promise<void> open;
+    auto gate = std::make_shared<GateSink>(open.get_future().share());
+    AsyncLog asyncLog(std::make_shared<spdlog::logger>("async_log_test", gate), 4, LogOverflow::Drop);
+
+    // The first line is stuck in the sink, and holds its slot, until the gate opens
+    for (int i = 0; i < 10; ++i) {
+        asyncLog.info("line {}", i);
+    }
+    EXPECT_EQ(asyncLog.dropped(), 6u);
+    open.set_value();
+    asyncLog.flush();
+    EXPECT_EQ(gate->written(), 5u);  // four lines and the drop notice
+
+    asyncLog.setOverflow(LogOverflow::Block);
+    for (int i = 0; i < 100; ++i) {
+        asyncLog.info("line {}", i);
+    }
+    asyncLog.flush();
+    EXPECT_EQ(asyncLog.dropped(), 6u);
+    EXPECT_EQ(gate->written(), 105u);
+}
+
+TEST(AsyncLogTest, DisabledWritesNothing) {
+    std::promise<void> open;
+    open.set_value();
+    auto gate = std::make_shared<GateSink>(open.get_future().share());
+    AsyncLog asyncLog(std::make_shared<spdlog::logger>("async_log_disabled_test", gate));
+
+    asyncLog.setEnabled(false);
+    for (int i = 0; i < 10; ++i) {
+        asyncLog.info("line {}", i);
+    }
+    asyncLog.setEnabled(true);
+    asyncLog.info("line {}", 10);
+    asyncLog.flush();
+    EXPECT_EQ(gate->written(), 1u);
+    EXPECT_EQ(asyncLog.dropped(), 0u);
+}
+
+// Time per CallCenter::clientCall() with no queueing and no service time,
+// which is dispatch, the call's timer on the WallClock and the log lines of
+// a served call. A benchmark; run it with --gtest_also_run_disabled_tests.
+TEST(LoggingBenchmark, DISABLED_DispatchLatencyWithLoggingOnAndOff) {
+    auto nanosecondsPerCall = [](bool logging) {
+        Logger::async().setEnabled(logging);
+        CallCenter callCenter(4, 0, 0);
+        const int calls = 1000;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < calls; ++i) {
+            callCenter.clientCall(i, 1000);
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        Logger::async().flush();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / calls;
+    };
+
+    nanosecondsPerCall(true);  // warm-up
+    auto on = nanosecondsPerCall(true);
+    auto off = nanosecondsPerCall(false);
+    Logger::async().setEnabled(true);
+
+    std::cout << "logging_on_ns_per_call=" << on << " logging_off_ns_per_call=" << off << std::endl;
+    EXPECT_GT(on, 0);
+    EXPECT_GT(off, 0);
+}
+
+enum TestSkill { Billing, Tech, Sales };
+
+TEST(SkillRouterTest, PicksTheLeastVersatileFreeOperator) {
+    SkillRouter router({ skillSet({ Billing, Tech }), skillSet({ Billing }), skillSet({ Tech }) }, 2000);
+    EXPECT_EQ(router.claimOperator(Billing), 1);
+    EXPECT_EQ(router.claimOperator(Billing), 0);
+    EXPECT_EQ(router.claimOperator(Billing), -1);
+    EXPECT_EQ(router.claimOperator(Tech), 2);
+    EXPECT_EQ(router.claimOperator(Sales), -1);
+}
+
+TEST(SkillRouterTest, VipsFirstFifoWithinAClassAndBoundedHeadStart) {
+    SkillRouter router({ skillSet({ Billing }) }, 1000);
+    ASSERT_EQ(router.claimOperator(Billing), 0);
+
+    int normalA = router.enqueue(Billing, Priority::Normal, 0);
+    int normalB = router.enqueue(Billing, Priority::Normal, 10);
+    int vip = router.enqueue(Billing, Priority::Vip, 20);
+    EXPECT_EQ(router.releaseOperator(0), vip);
+    EXPECT_EQ(router.releaseOperator(0), normalA);
+    EXPECT_EQ(router.releaseOperator(0), normalB);
+
+    // A normal client that has waited longer than the head start is not
+    // passed over any more
+    int patient = router.enqueue(Billing, Priority::Normal, 5000);
+    int lateVip = router.enqueue(Billing, Priority::Vip, 6500);
+    EXPECT_EQ(router.releaseOperator(0), patient);
+    EXPECT_EQ(router.releaseOperator(0), lateVip);
+    EXPECT_EQ(router.releaseOperator(0), -1);
+}
+
+TEST(SkillRouterTest, FreedOperatorServesOnlyItsSkills) {
+    SkillRouter router({ skillSet({ Tech }), skillSet({ Billing, Tech }) }, 1000);
+    ASSERT_EQ(router.claimOperator(Tech), 0);
+    ASSERT_EQ(router.claimOperator(Tech), 1);
+
+    int billing = router.enqueue(Billing, Priority::Normal, 0);
+    int tech = router.enqueue(Tech, Priority::Normal, 10);
+    EXPECT_EQ(router.releaseOperator(0), tech);
+    EXPECT_EQ(router.releaseOperator(0), -1);
+    EXPECT_EQ(router.releaseOperator(1), billing);
+
+    int cancelled = router.enqueue(Billing, Priority::Vip, 20);
+    router.cancel(cancelled);
+    EXPECT_EQ(router.waiting(Billing), 0u);
+    EXPECT_EQ(router.releaseOperator(1), -1);
+    EXPECT_EQ(router.claimOperator(Tech), 0);  // keeps the billing operator free
+}
+
+TEST(SkillRouterTest, RejectsSkillsOutOfRange) {
+    EXPECT_THROW(skillSet({ Billing, 64 }), std::invalid_argument);
+    SkillRouter router({ skillSet({ Billing }) }, 1000);
+    EXPECT_THROW(router.claimOperator(64), std::invalid_argument);
+    EXPECT_THROW(router.enqueue(-1, Priority::Normal, 0), std::invalid_argument);
+
+    SimulatedClock clock;
+    CallCenter callCenter(clock, std::make_unique<SkillRouter>(std::vector<SkillSet>{ skillSet({ Billing }) }, 1000),
+                          std::make_shared<UniformServiceTime>(50, 50), 1);
+    EXPECT_THROW(callCenter.call({ 0, 1000, -1, 100, Priority::Normal }), std::invalid_argument);
+    CallResult result{ false, -1, 0 };
+    callCenter.call({ 1, 1000, -1, Billing, Priority::Normal }, [&](const CallResult& ended) { result = ended; });
+    clock.run();
+    EXPECT_TRUE(result.served);
+    EXPECT_EQ(result.operatorId, 0);
+}
+
+TEST(SkillRoutingTest, ClientsReachOperatorsWithTheirSkill) {
+    SimulatedClock clock;
+    std::vector<SkillSet> operatorSkills{ skillSet({ Billing }), skillSet({ Tech }) };
+    CallCenter callCenter(clock, std::make_unique<SkillRouter>(operatorSkills, 2000),
+                          std::make_shared<UniformServiceTime>(50, 50), 1);
+    std::vector<int> servedBy(7, -2);
+    for (int i = 0; i < 6; ++i) {
+        int skill = i % 2 == 0 ? Billing : Tech;
+        callCenter.call({ i, 1000, -1, skill, Priority::Normal },
+                        [&servedBy, i](const CallResult& result) { servedBy[i] = result.operatorId; });
+    }
+    callCenter.call({ 6, 50, -1, Sales, Priority::Vip },
+                    [&servedBy](const CallResult& result) { servedBy[6] = result.operatorId; });
+    clock.run();
+
+    for (int i = 0; i < 6; ++i) {
+        EXPECT_EQ(servedBy[i], i % 2 == 0 ? 0 : 1);
+    }
+    EXPECT_EQ(servedBy[6], -1);  // nobody has the skill; hangs up
+    CallStatsSnapshot stats = callCenter.stats().snapshot();
+    EXPECT_EQ(stats.wait.max(), 100u * 1000);  // third in line for its operator
+    EXPECT_EQ(stats.abandon.max(), 50u * 1000);
+}
+
+TEST(HistogramTest, PercentilesWithinABucket) {
+    Histogram histogram;
+    for (uint64_t v = 1; v <= 100000; ++v) {
+        histogram.record(v);
+    }
+    EXPECT_EQ(histogram.count(), 100000u);
+    EXPECT_EQ(histogram.min(), 1u);
+    EXPECT_EQ(histogram.max(), 100000u);
+    EXPECT_DOUBLE_EQ(histogram.mean(), 50000.5);
+    for (double p : { 0.5, 0.9, 0.99 }) {
+        double exact = p * 100000;
+        EXPECT_NEAR(static_cast<double>(histogram.percentile(p)), exact, exact / Histogram::SUB_BUCKETS);
+    }
+    EXPECT_EQ(histogram.percentile(1.0), 100000u);
+}
+
+TEST(ErlangTest, KnownValues) {
+    EXPECT_NEAR(erlangC(2, 1.0), 1.0 / 3, 1e-12);
+    EXPECT_NEAR(erlangC(10, 8.0), 0.4092, 1e-4);
+    EXPECT_EQ(erlangC(3, 3.0), 1.0);
+    // One agent is M/M/1: P(wait <= t) = 1 - rho * e^(-(1 - rho) t / s)
+    EXPECT_NEAR(erlangServiceLevel(1, 0.5, 1.0, 2.0), 1 - 0.5 * std::exp(-1.0), 1e-12);
+}
+
+TEST(CallStatsTest, ThreadsRecordWithoutLosingCalls) {
+    SimulatedClock clock;
+    CallStats stats(clock);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&stats, t] {
+            for (int i = 0; i < 10000; ++i) {
+                if (i % 10 == 0) {
+                    stats.recordAbandoned(std::chrono::microseconds(5000));
+                }
+                else {
+                    stats.recordServed(std::chrono::microseconds(t * 100 + i % 100), std::chrono::microseconds(1000));
+                }
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
     }
+    CallStatsSnapshot snapshot = stats.snapshot();
+    EXPECT_EQ(snapshot.served(), 72000u);
+    EXPECT_EQ(snapshot.abandoned(), 8000u);
+    EXPECT_EQ(snapshot.service.sum(), 72000u * 1000);
+    EXPECT_EQ(snapshot.wait.max(), 799u);
+    EXPECT_NEAR(snapshot.abandonRate(), 0.1, 1e-12);
+}
 
+TEST(CallStatsTest, ReportAgainstErlangC) {
+    const int operators = 4;
+    CallCenter callCenter(operators, 10, 20);
+    std::mt19937 gen(7);
+    std::exponential_distribution<double> gap(1.0 / 7.5);  // 2 Erlangs offered
+    std::vector<std::thread> clientThreads;
+    for (int i = 0; i < 100; ++i) {
+        clientThreads.emplace_back([&callCenter, i]() { callCenter.clientCall(i, 1000); });
+        std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(gap(gen) * 1000)));
+    }
     for (auto& th : clientThreads) {
         th.join();
     }
-    ASSERT_TRUE(true);
+
+    CallStatsSnapshot stats = callCenter.stats().snapshot();
+    EXPECT_EQ(stats.calls(), 100u);
+    EXPECT_GE(stats.service.min(), 10000u);
+    double utilization = stats.utilization(operators);
+    EXPECT_GT(utilization, 0.0);
+    EXPECT_LE(utilization, 1.0);
+    std::string report = stats.report(operators, 20);
+    EXPECT_NE(report.find("calls 100 served"), std::string::npos);
+    EXPECT_NE(report.find("Erlang C"), std::string::npos);
+}
+
+TEST(WorkloadTest, EachClientHasItsOwnStream) {
+    RandomStreams streams(42);
+    RandomStreams sameSeed(42);
+    uint64_t first = streams.forClient(7)();
+    EXPECT_EQ(sameSeed.forClient(7)(), first);
+    uint64_t onAnotherThread = 0;
+    std::thread([&] { onAnotherThread = streams.forClient(7)(); }).join();
+    EXPECT_EQ(onAnotherThread, first);
+    EXPECT_NE(streams.forClient(8)(), first);
+    EXPECT_NE(RandomStreams(43).forClient(7)(), first);
+}
+
+TEST(WorkloadTest, ServiceTimeDistributions) {
+    CallRandom rng(1);
+    LognormalServiceTime lognormal(600, 0.8);
+    double sum = 0;
+    int64_t longest = 0;
+    for (int i = 0; i < 200000; ++i) {
+        int64_t sample = lognormal.sampleMs(rng);
+        sum += sample;
+        longest = std::max(longest, sample);
+    }
+    EXPECT_NEAR(sum / 200000, lognormal.meanMs(), lognormal.meanMs() * 0.02);
+    EXPECT_GT(longest, 10 * 600);  // the long tail
+
+    EmpiricalServiceTime empirical({ 100, 200, 900 });
+    sum = 0;
+    for (int i = 0; i < 30000; ++i) {
+        int64_t sample = empirical.sampleMs(rng);
+        EXPECT_TRUE(sample == 100 || sample == 200 || sample == 900);
+        sum += sample;
+    }
+    EXPECT_NEAR(sum / 30000, 400, 10);
+}
+
+TEST(WorkloadTest, BurstsWaitLongerThanPoissonAtTheSameRate) {
+    auto meanWaitMs = [](std::shared_ptr<ArrivalProcess> arrivals) {
+        QuietLog quiet;
+        SimulatedClock clock;
+        CallCenter callCenter(clock, 9, std::make_shared<LognormalServiceTime>(600, 0.5), 3);
+        scheduleArrivals(clock, callCenter, std::move(arrivals), 600000, 4);
+        clock.run(std::numeric_limits<int64_t>::max());
+        return callCenter.stats().snapshot().wait.mean() / 1e3;
+    };
+
+    auto bursty = std::make_shared<BurstyProcess>(5.0, 55.0, 9000, 1000, 50000);
+    ASSERT_DOUBLE_EQ(bursty->callsPerSecond(), 10.0);
+    double poissonWait = meanWaitMs(std::make_shared<PoissonProcess>(10.0, 50000));
+    double burstyWait = meanWaitMs(bursty);
+    EXPECT_GT(burstyWait, 3 * poissonWait);
+}
+
+TEST(WorkloadTest, ReplaysACsvTrace) {
+    std::string path = (std::filesystem::temp_directory_path() / "call_center_trace_test.csv").string();
+    {
+        std::ofstream out(path);
+        out << "arrival_ms,service_ms,max_wait_ms\n"
+            << "1000,500\n"
+            << "1100,500,300\n"
+            << "1200,500\n"
+            << "\n"
+            << "1800,100\n";
+    }
+    TraceReplay trace = TraceReplay::loadCsv(path);
+    std::filesystem::remove(path);
+    ASSERT_EQ(trace.size(), 4u);
+
+    SimulatedClock clock;
+    CallCenter callCenter(clock, 1, 1, 1, 0);
+    scheduleArrivals(clock, callCenter, std::make_shared<TraceReplay>(trace), 1000, 0);
+    clock.run(std::numeric_limits<int64_t>::max());
+
+    // The second client gives up after 300 ms; the others wait for the one operator
+    CallStatsSnapshot stats = callCenter.stats().snapshot();
+    EXPECT_EQ(stats.served(), 3u);
+    EXPECT_EQ(stats.abandoned(), 1u);
+    EXPECT_EQ(stats.wait.sum(), (300u + 200) * 1000);
+    EXPECT_EQ(stats.wait.max(), 300u * 1000);
+
+    std::istringstream broken("0,10\n5\n");
+    EXPECT_THROW(TraceReplay::parseCsv(broken), std::runtime_error);
+    std::istringstream unordered("10,10\n5,10\n");
+    EXPECT_THROW(TraceReplay::parseCsv(unordered), std::runtime_error);
+    std::istringstream negativeWait("0,10,100\n5,10,-1\n");
+    EXPECT_THROW(TraceReplay::parseCsv(negativeWait), std::runtime_error);
+    std::istringstream hugeWait("0,10,100\n5,10,2147483648\n");
+    try {
+        TraceReplay::parseCsv(hugeWait, "huge.csv");
+        ADD_FAILURE() << "a max_wait_ms past INT_MAX was accepted";
+    }
+    catch (const std::runtime_error& error) {
+        EXPECT_EQ(std::string(error.what()).rfind("huge.csv:2: ", 0), 0u) << error.what();
+    }
+}
+
+// Bursty traffic with long-tailed calls, written to CSV and read back as a
+// recorded trace would be
+TraceReplay burstyTrace(int callCount) {
+    std::mt19937_64 rng(11);
+    CallRandom serviceRng(12);
+    BurstyProcess arrivals(3.0, 30.0, 20000, 2000, callCount);
+    LognormalServiceTime serviceTime(400, 0.9);
+    std::stringstream csv;
+    csv << "arrival_ms,service_ms\n";
+    int64_t arrivalMs = 0;
+    CallArrival call;
+    while (arrivals.next(rng, call)) {
+        arrivalMs += call.gapMs;
+        csv << arrivalMs << ',' << serviceTime.sampleMs(serviceRng) << '\n';
+    }
+    return TraceReplay::parseCsv(csv);
+}
+
+CallStatsSnapshot replayWithOperators(const TraceReplay& trace, int operators) {
+    SimulatedClock clock;
+    CallCenter callCenter(clock, operators, 1, 1, 0);
+    scheduleArrivals(clock, callCenter, std::make_shared<TraceReplay>(trace), 20000, 0);
+    clock.run(std::numeric_limits<int64_t>::max());
+    return callCenter.stats().snapshot();
+}
+
+TEST(WorkloadTest, MoreOperatorsNeverLoseMoreCalls) {
+    QuietLog quiet;
+    TraceReplay trace = burstyTrace(5000);
+    double offeredErlangs = static_cast<double>(trace.totalServiceMs()) / trace.spanMs();
+    uint64_t previousHungUp = std::numeric_limits<uint64_t>::max();
+    for (int operators = static_cast<int>(offeredErlangs); operators <= 4 * offeredErlangs + 1; ++operators) {
+        CallStatsSnapshot stats = replayWithOperators(trace, operators);
+        EXPECT_EQ(stats.calls(), trace.size());
+        EXPECT_LE(stats.abandoned(), previousHungUp);
+        previousHungUp = stats.abandoned();
+    }
+    EXPECT_GT(replayWithOperators(trace, static_cast<int>(offeredErlangs)).abandoned(), previousHungUp);
+}
+
+// How many operators a day of bursty traffic needs. A benchmark; run it
+// with --gtest_also_run_disabled_tests.
+TEST(TraceCapacityBenchmark, DISABLED_OperatorsNeededForTrace) {
+    TraceReplay trace = burstyTrace(100000);
+    double offeredErlangs = static_cast<double>(trace.totalServiceMs()) / trace.spanMs();
+
+    QuietLog quiet;
+    int needed = 0;
+    for (int operators = static_cast<int>(offeredErlangs); operators <= 4 * offeredErlangs + 1; ++operators) {
+        CallStatsSnapshot stats = replayWithOperators(trace, operators);
+        double meanWaitMs = stats.wait.mean() / 1e3;
+        std::cout << "operators=" << operators << " hung_up=" << stats.abandoned() << " mean_wait_ms=" << meanWaitMs
+                  << std::endl;
+        if (meanWaitMs < 1000 && stats.abandoned() * 100 < trace.size()) {
+            needed = operators;
+            break;
+        }
+    }
+    std::cout << "offered_erlangs=" << offeredErlangs << " operators_needed=" << needed << std::endl;
+    EXPECT_GT(needed, offeredErlangs);
 }
 
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
 
-    Logger::getInstance()->info("Starting Call Center Tests...");
+    log("Starting Call Center Tests...");
 
     return RUN_ALL_TESTS();
 }